@@ -9,6 +9,29 @@
 #include <math.h>
 #include <limits>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <initializer_list>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <deque>
+#include "peopleCounter/counterLog.h"
 
 using namespace std;
 #define RASP_MODE       1
@@ -30,17 +53,120 @@ using namespace std;
 
 #endif
 
-#define SIZE_PIXELS     (WIDTH*HEIGHT*4)
+/*Everything is simulated and composited at WIDTH/RENDER_SCALE x HEIGHT/RENDER_SCALE,
+  the renderer scales the texture up to the WIDTH x HEIGHT window*/
+#define RENDER_SCALE    1
+#define RENDER_WIDTH    (WIDTH/RENDER_SCALE)
+#define RENDER_HEIGHT   (HEIGHT/RENDER_SCALE)
+/*Form radii are given at window resolution*/
+#define SCALED_RADIUS(radius)   ((((radius)/RENDER_SCALE) > 0) ? ((radius)/RENDER_SCALE) : 1)
+
+#define SIZE_PIXELS     (RENDER_WIDTH*RENDER_HEIGHT*4)
+
+/*Store the working pattern as packed 8 byte cells in tiles of 8x8 (512 bytes), so a
+  sample reads one cache line instead of one in the sigma plane and one in the colors.
+  Off by default: --bench-layout measures it slower than the uint8 class plane next to
+  the hsv plane, at 1280x1024 and at the RASP_MODE size. Turn it on only where the
+  benchmark on the target shows fewer misses and a lower time per sample*/
+#define PACKED_CELLS    0
+#define TILE_SHIFT      3
+#define TILE_SIZE       (1 << TILE_SHIFT)
+
+/*Composite 16 bit palette indexes instead of BGRA, entry 1 + n is the color of
+  slot n of the pixel ring and 0 is the background. The indexes are expanded to
+  ARGB8888 straight into the locked texture*/
+#define PALETTE_COMPOSITE   RASP_MODE
+#define PALETTE_SIZE        (1 + PIXELS_PER_RUN*N_BUFFERS)
 #define SMOOTH_TRANSITION   0
 
 #define TIME_DEBUG          0
 
 #define GLOBAL_SIGMA        0
 
+/*Sigmas are stored as a log2 class, this many classes per octave*/
+#define SIGMA_CLASS_STEPS   15
+#define N_SIGMA_CLASSES     256
+
+/*Draw stamp positions from an alias table built per sigma plane at load time.
+  The weight of a pixel is (1 + sigma)^-IMPORTANCE_EXPONENT, never below IMPORTANCE_FLOOR,
+  so a positive exponent favours low sigma and a negative one favours high sigma
+  (the letters of the .res logos are the high sigma pixels)*/
+#define IMPORTANCE_SAMPLING     0
+#define IMPORTANCE_EXPONENT     (-0.2)
+#define IMPORTANCE_FLOOR        0.01
+
+/*Watch the .res files and swap the new sigmas in at the next pattern change*/
+#define HOT_RELOAD          1
+#define HOT_RELOAD_PERIOD_MS    500
+
+
+/*Messages from the render loop and the other threads go through a lock free ring of
+  fixed size records, a drain thread formats and writes them. Records below LOG_LEVEL
+  are dropped where they are made, and so are records that find the ring full*/
+#define LOG_LEVEL           LOG_INFO
+#define LOG_RING_SIZE       1024        // a power of two
+#define LOG_MAX_ARGS        6
+#define LOG_DRAIN_MS        50
+#define LOG_LINE_SIZE       256
+
+/*Build the pattern planes on a pool of threads, the first frame is drawn as soon as
+  the initial pattern is ready and patterns still being built are skipped*/
+#define PARALLEL_STARTUP    1
+
+/*All frame sized buffers are carved from one arena, aligned for vector loads*/
+#define ARENA_ALIGN         64
+#define ARENA_HUGEPAGES     1
+#define HUGEPAGE_SIZE       (2*1024*1024)
+/*Fault every arena page in when it is created, not on the first frames*/
+#define ARENA_PREFAULT      1
+#define ALIGN_UP(size, align)   ((((size_t)(size)) + (align) - 1) & ~((size_t)(align) - 1))
+
+/*Patterns, transitions and the pixel lifetime are counted in simulation ticks
+  of a fixed wall clock length, a slow frame runs several ticks and draws once*/
+#define FIXED_TIMESTEP      1
+#define SIM_TICK_HZ         60
+#define MAX_TICKS_PER_FRAME 4
+
+/*Input traces for --record and --replay*/
+#define TRACE_MAGIC         0x43525442      // "BTRC"
+#define TRACE_VERSION       2       // 2: own random generator instead of rand()
+#define TRACE_FLUSH_FRAMES  SIM_TICK_HZ     // a killed recording loses at most this many frames
+
+/*Warm start: the render state is copied every SNAPSHOT_PERIOD ticks and written to one
+  of the two slots of SNAPSHOT_FILE (or --snapshot file) by a writer thread, a restart
+  resumes from the newest complete slot. Not used by --record and --replay. The default
+  is on tmpfs, it outlives the process the watchdog restarts and never reaches the SD card*/
+#define WARM_START          1
+#define SNAPSHOT_FILE       "/dev/shm/brisa.snap"
+#define SNAPSHOT_PERIOD     SIM_TICK_HZ
+#define SNAPSHOT_POLL_MS    100
+#define SNAPSHOT_MAGIC      0x50534E42      // "BNSP"
+#define SNAPSHOT_VERSION    2       // 2: pattern_id inside the checksum
+#define SNAPSHOT_SLOT_ALIGN 4096
+
+/*With peopleCounter/reader running, the density follows the average count of the last
+  COUNT_WINDOW_MS from counter.log instead of the latest value in counter.bin. A log whose
+  newest sample is older than the window, or than counter.bin (fakecounter.py, reader.py),
+  is left alone and counter.bin is read again*/
+#define COUNT_WINDOW_MS         30000
+#define COUNT_LOG_RETRY_FRAMES  SIM_TICK_HZ     // how often to look for counter.log while it is missing
+#define COUNT_BIN_SLACK_MS      1000            // reader writes counter.bin just after the sample
 
 #define READ_SIZE       6
 #define N_PATTERNS      11
 
+/*Stamps shrink and fade while they age in the ring. The age of a ring buffer picks one
+  of AGE_CLASSES sprites per form, built at startup as spans, and a fade table entry.
+  The oldest class is drawn at AGE_MIN_SCALE of the radius and AGE_MIN_INTENSITY*/
+#define STAMP_AGING         1
+#if STAMP_AGING
+    #define AGE_CLASSES     8
+#else
+    #define AGE_CLASSES     1
+#endif
+#define AGE_MIN_SCALE       0.4
+#define AGE_MIN_INTENSITY   0.3
+
 #define MULTIPLE_GEOMETRIES     1
 #define MULTIPLE_SIZES          0
 
@@ -79,18 +205,609 @@ typedef struct {
     double v;       // a fraction between 0 and 1
 } hsv;
 
+/*One alias table entry per pixel, keep the pixel if next_random() <= prob, otherwise take alias*/
+typedef struct {
+    uint32_t    prob;
+    uint32_t    alias;
+} alias_entry;
+
+/*Non owning views of the arena planes, these are what the kernels receive*/
+typedef struct {
+    uint8_t     *data;      // sigma class, see sigma_to_class
+    uint16_t    width;
+    uint16_t    height;
+    alias_entry *alias;     // NULL when the plane is not importance sampled
+    uint8_t     weighted;   // 0 when every pixel has the same weight, draw uniformly then
+} std_plane;
+
+typedef struct {
+    uint16_t    *data;      // h, s, v for each pixel
+    uint16_t    width;
+    uint16_t    height;
+} color_plane;
+
+typedef struct {
+    uint8_t     *data;      // BGRA for each pixel
+    uint16_t    width;
+    uint16_t    height;
+} frame_plane;
+
+typedef struct {
+    uint16_t    *data;      // palette index for each pixel
+    uint16_t    width;
+    uint16_t    height;
+} index_plane;
+
+#if PALETTE_COMPOSITE
+static_assert(PALETTE_SIZE <= 0x10000, "PALETTE_COMPOSITE needs the pixel ring to fit in 16 bit indexes");
+#endif
+
+/*Everything a sample reads about a pixel, in a single 8 byte record*/
+typedef struct {
+    uint16_t    sigma_class;
+    uint16_t    h;
+    uint16_t    s;
+    uint16_t    v;
+} cell;
+
+#if PACKED_CELLS
+typedef struct {
+    cell        *data;      // tiles of TILE_SIZE x TILE_SIZE cells, see tile_offset
+    uint16_t    width;
+    uint16_t    height;
+    uint16_t    tiles_per_row;
+} cell_plane;
+#else
+typedef struct {
+    uint8_t     *sigma_class;   // row major, as the std planes
+    uint16_t    *hsv;           // row major, as the color planes
+    uint16_t    width;
+    uint16_t    height;
+} cell_plane;
+#endif
+
+/*Owns the single allocation every frame sized buffer is carved from*/
+struct frame_arena {
+    uint8_t     *base;
+    size_t      size;
+    size_t      used;
+    bool        huge;
+    bool        prefaulted;
+
+    frame_arena(size_t wanted);
+    ~frame_arena();
+    void *alloc(size_t bytes);
+    frame_arena(const frame_arena&) = delete;
+    frame_arena &operator=(const frame_arena&) = delete;
+};
+
+frame_arena::frame_arena(size_t wanted)
+{
+    used = 0;
+    huge = false;
+    prefaulted = false;
+#if ARENA_HUGEPAGES
+    size = ALIGN_UP(wanted, HUGEPAGE_SIZE);
+#else
+    size = ALIGN_UP(wanted, ARENA_ALIGN);
+#endif
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        base = NULL;
+        size = 0;
+        return;
+    }
+    base = (uint8_t*)mem;
+#if ARENA_HUGEPAGES && defined(MADV_HUGEPAGE)
+    huge = (madvise(base, size, MADV_HUGEPAGE) == 0);
+#endif
+#if ARENA_PREFAULT
+    /*Nothing is allocated yet, so writing zeros is safe where populate is missing*/
+#ifdef MADV_POPULATE_WRITE
+    prefaulted = (madvise(base, size, MADV_POPULATE_WRITE) == 0);
+#endif
+    if (!prefaulted)
+    {
+        memset(base, 0, size);
+        prefaulted = true;
+    }
+#endif
+}
+
+frame_arena::~frame_arena()
+{
+    if (base != NULL)
+    {
+        munmap(base, size);
+    }
+}
+
+void *frame_arena::alloc(size_t bytes)
+{
+    size_t start = ALIGN_UP(used, ARENA_ALIGN);
+    if ((base == NULL) || (start + bytes > size))
+    {
+        return NULL;
+    }
+    used = start + bytes;
+    return base + start;
+}
+
+enum {
+    LOG_DEBUG   = 0,
+    LOG_INFO    = 1,
+    LOG_WARN    = 2,
+    LOG_ERROR   = 3
+};
+
+/*fmt is a printf format with a %s first when text is set, then one double conversion
+  per arg. Both pointers are only read by the drain thread, they have to outlive it,
+  string literals do*/
+typedef struct {
+    atomic<uint32_t>    seq;        // slot position + 1 once published, see log_push
+    uint8_t             level;
+    uint8_t             n_args;
+    uint16_t            reserved;
+    uint32_t            suppressed; // records of the same site dropped by its rate limit
+    double              time_ms;
+    const char          *fmt;
+    const char          *text;
+    double              args[LOG_MAX_ARGS];
+} log_record;
+
+/*Bounded multi producer ring, producers claim a slot with a CAS on head and publish it
+  with its seq, the single drain thread follows with tail*/
+typedef struct {
+    log_record          records[LOG_RING_SIZE];
+    atomic<uint32_t>    head;
+    uint32_t            tail;
+    atomic<uint32_t>    dropped;
+    chrono::steady_clock::time_point begin;
+} log_ring;
+
+/*One per LOG_EVERY call site*/
+typedef struct {
+    atomic<int64_t>     next_ns;
+    atomic<uint32_t>    suppressed;
+} log_site;
+
+static log_ring app_log;
+
+void log_push(uint8_t level, const char *fmt, const char *text, initializer_list<double> args, uint32_t suppressed = 0)
+{
+    uint32_t pos = app_log.head.load(memory_order_relaxed);
+    log_record *record;
+    for (;;)
+    {
+        record = &app_log.records[pos & (LOG_RING_SIZE - 1)];
+        const int32_t diff = (int32_t)(record->seq.load(memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (app_log.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /*Full, the drain is behind*/
+            app_log.dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = app_log.head.load(memory_order_relaxed);
+        }
+    }
+    record->level = level;
+    record->n_args = 0;
+    record->suppressed = suppressed;
+    record->time_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - app_log.begin).count();
+    record->fmt = fmt;
+    record->text = text;
+    for (double arg : args)
+    {
+        if (record->n_args < LOG_MAX_ARGS)
+        {
+            record->args[record->n_args++] = arg;
+        }
+    }
+    record->seq.store(pos + 1, memory_order_release);
+}
+
+void log_push_every(log_site *site, int64_t period_ms, uint8_t level, const char *fmt, const char *text, initializer_list<double> args)
+{
+    const int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t next = site->next_ns.load(memory_order_relaxed);
+    if ((now < next) || !site->next_ns.compare_exchange_strong(next, now + period_ms*1000000, memory_order_relaxed))
+    {
+        site->suppressed.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    log_push(level, fmt, text, args, site->suppressed.exchange(0, memory_order_relaxed));
+}
+
+#define LOG(level, fmt, ...) \
+    do { if ((level) >= LOG_LEVEL) log_push((level), (fmt), NULL, {__VA_ARGS__}); } while (0)
+#define LOG_TEXT(level, fmt, text, ...) \
+    do { if ((level) >= LOG_LEVEL) log_push((level), (fmt), (text), {__VA_ARGS__}); } while (0)
+/*At most one record every period_ms from this line, the next one says how many were dropped*/
+#define LOG_EVERY(period_ms, level, fmt, ...) \
+    do { if ((level) >= LOG_LEVEL) { static log_site site_; log_push_every(&site_, (period_ms), (level), (fmt), NULL, {__VA_ARGS__}); } } while (0)
+
+/*Formats and writes everything published so far, returns how many records it wrote*/
+uint32_t drain_log(FILE *out)
+{
+    static const char level_names[] = {'D', 'I', 'W', 'E'};
+    char line[LOG_LINE_SIZE];
+    uint32_t n = 0;
+    for (;;)
+    {
+        log_record *record = &app_log.records[app_log.tail & (LOG_RING_SIZE - 1)];
+        if (record->seq.load(memory_order_acquire) != app_log.tail + 1)
+        {
+            break;
+        }
+        double a[LOG_MAX_ARGS] = {0};
+        for (uint8_t i = 0; i < record->n_args; i++)
+        {
+            a[i] = record->args[i];
+        }
+        if (record->text != NULL)
+        {
+            snprintf(line, sizeof(line), record->fmt, record->text, a[0], a[1], a[2], a[3], a[4], a[5]);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), record->fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+        }
+        fprintf(out, "[%10.3f %c] %s", record->time_ms / 1000.0, level_names[record->level & 3], line);
+        if (record->suppressed)
+        {
+            fprintf(out, " (+%u suppressed)", record->suppressed);
+        }
+        fputc('\n', out);
+        record->seq.store(app_log.tail + LOG_RING_SIZE, memory_order_release);
+        app_log.tail++;
+        n++;
+    }
+    const uint32_t dropped = app_log.dropped.exchange(0, memory_order_relaxed);
+    if (dropped)
+    {
+        fprintf(out, "%u log records dropped, the ring was full\n", dropped);
+    }
+    if (n || dropped)
+    {
+        fflush(out);
+    }
+    return n;
+}
+
+/*Owns the drain thread, whatever is left in the ring is written when it goes out of scope*/
+struct log_drain {
+    thread              worker;
+    atomic<bool>        running;
+
+    log_drain();
+    ~log_drain();
+    void run();
+    log_drain(const log_drain&) = delete;
+    log_drain &operator=(const log_drain&) = delete;
+};
+
+log_drain::log_drain() : running(true)
+{
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        app_log.records[i].seq.store(i, memory_order_relaxed);
+    }
+    app_log.head = 0;
+    app_log.tail = 0;
+    app_log.dropped = 0;
+    app_log.begin = chrono::steady_clock::now();
+    worker = thread(&log_drain::run, this);
+}
+
+log_drain::~log_drain()
+{
+    running = false;
+    worker.join();
+    cout.flush();
+    drain_log(stdout);
+}
+
+void log_drain::run()
+{
+    while (running.load())
+    {
+        this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_MS));
+        /*Keep the order of the cout lines of the main thread*/
+        cout.flush();
+        drain_log(stdout);
+    }
+}
+
+/*Runs the startup jobs on a few threads. Every job is registered with the buffer it
+  fills, so the readiness of a pattern can be looked up from its planes*/
+struct asset_pool {
+    vector<function<void()>>    jobs;
+    vector<const void*>         outputs;
+    vector<promise<void>>       done;
+    vector<shared_future<void>> ready;
+    atomic<uint32_t>            next;
+    atomic<uint32_t>            finished;
+    vector<thread>              workers;
+    chrono::steady_clock::time_point begin;
+
+    asset_pool();
+    ~asset_pool();
+    void add(const void *output, function<void()> job);
+    shared_future<void> ready_of(const void *output);
+    void start(uint8_t n_workers, chrono::steady_clock::time_point startup_begin);
+    void run_jobs();
+    void join();
+    asset_pool(const asset_pool&) = delete;
+    asset_pool &operator=(const asset_pool&) = delete;
+};
+
+asset_pool::asset_pool() : next(0), finished(0)
+{
+}
+
+asset_pool::~asset_pool()
+{
+    join();
+}
+
+/*Jobs run in the order they are added, add the ones the first frame needs first*/
+void asset_pool::add(const void *output, function<void()> job)
+{
+    jobs.push_back(job);
+    outputs.push_back(output);
+    done.push_back(promise<void>());
+    ready.push_back(done.back().get_future().share());
+}
+
+/*A buffer no job writes to is ready from the start*/
+shared_future<void> asset_pool::ready_of(const void *output)
+{
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if (outputs[i] == output)
+        {
+            return ready[i];
+        }
+    }
+    promise<void> none;
+    none.set_value();
+    return none.get_future().share();
+}
+
+/*Without workers the jobs run here, before start returns*/
+void asset_pool::start(uint8_t n_workers, chrono::steady_clock::time_point startup_begin)
+{
+    begin = startup_begin;
+    if (n_workers == 0)
+    {
+        run_jobs();
+        return;
+    }
+    for (uint8_t i = 0; i < n_workers; i++)
+    {
+        workers.push_back(thread(&asset_pool::run_jobs, this));
+    }
+}
+
+void asset_pool::run_jobs()
+{
+    uint32_t i;
+    while ((i = next.fetch_add(1)) < jobs.size())
+    {
+        jobs[i]();
+        done[i].set_value();
+        if (finished.fetch_add(1) + 1 == jobs.size())
+        {
+            LOG(LOG_INFO, "All patterns ready after %.1f ms", chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+        }
+    }
+}
+
+void asset_pool::join()
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    workers.clear();
+}
+
+inline bool future_ready(const shared_future<void> &future)
+{
+    return future.wait_for(chrono::seconds(0)) == future_status::ready;
+}
+
+std_plane alloc_std_plane(frame_arena &arena, bool with_alias)
+{
+    std_plane plane = {(uint8_t*)arena.alloc(RENDER_WIDTH*RENDER_HEIGHT*sizeof(uint8_t)), RENDER_WIDTH, RENDER_HEIGHT, NULL, 0};
+    if (with_alias)
+    {
+        plane.alias = (alias_entry*)arena.alloc(RENDER_WIDTH*RENDER_HEIGHT*sizeof(alias_entry));
+    }
+    return plane;
+}
+
+color_plane alloc_color_plane(frame_arena &arena)
+{
+    color_plane plane = {(uint16_t*)arena.alloc(RENDER_WIDTH*RENDER_HEIGHT*3*sizeof(uint16_t)), RENDER_WIDTH, RENDER_HEIGHT};
+    return plane;
+}
+
+size_t tiled_size(uint16_t width, uint16_t height)
+{
+    return (size_t)ALIGN_UP(width, TILE_SIZE)*ALIGN_UP(height, TILE_SIZE)*sizeof(cell);
+}
+
+/*Tiles are stored row by row and so are the cells inside a tile*/
+inline uint32_t tile_offset(uint32_t tiles_per_row, uint32_t x, uint32_t y)
+{
+    const uint32_t tile = (y >> TILE_SHIFT)*tiles_per_row + (x >> TILE_SHIFT);
+    return (tile << (2*TILE_SHIFT)) + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+}
+
+size_t cell_plane_size(uint16_t width, uint16_t height)
+{
+#if PACKED_CELLS
+    return tiled_size(width, height);
+#else
+    return ALIGN_UP((size_t)width*height*sizeof(uint8_t), ARENA_ALIGN) + (size_t)width*height*3*sizeof(uint16_t);
+#endif
+}
+
+cell_plane alloc_cell_plane(frame_arena &arena, uint16_t width, uint16_t height)
+{
+#if PACKED_CELLS
+    cell_plane plane = {(cell*)arena.alloc(tiled_size(width, height)), width, height,
+                        (uint16_t)(ALIGN_UP(width, TILE_SIZE) >> TILE_SHIFT)};
+#else
+    cell_plane plane;
+    plane.sigma_class = (uint8_t*)arena.alloc((size_t)width*height*sizeof(uint8_t));
+    plane.hsv = (uint16_t*)arena.alloc((size_t)width*height*3*sizeof(uint16_t));
+    plane.width = width;
+    plane.height = height;
+#endif
+    return plane;
+}
+
+inline cell get_cell(const cell_plane *plane, uint32_t x, uint32_t y)
+{
+#if PACKED_CELLS
+    return plane->data[tile_offset(plane->tiles_per_row, x, y)];
+#else
+    const uint32_t pos = y*plane->width + x;
+    cell c = {plane->sigma_class[pos], plane->hsv[pos*3 + 0], plane->hsv[pos*3 + 1], plane->hsv[pos*3 + 2]};
+    return c;
+#endif
+}
+
+inline void set_cell(cell_plane *plane, uint32_t x, uint32_t y, cell c)
+{
+#if PACKED_CELLS
+    plane->data[tile_offset(plane->tiles_per_row, x, y)] = c;
+#else
+    const uint32_t pos = y*plane->width + x;
+    plane->sigma_class[pos] = c.sigma_class;
+    plane->hsv[pos*3 + 0] = c.h;
+    plane->hsv[pos*3 + 1] = c.s;
+    plane->hsv[pos*3 + 2] = c.v;
+#endif
+}
+
 /*defined this strcut this way, because it refers to itself*/
 typedef struct pattern {
-    double      *std;
-    uint16_t    *color;
+    std_plane   std;
+    color_plane color;
     /*If next_pattern is NULL the next one will be random*/
     pattern     *next_pattern;
     /*If not is_first that means that this pattern can't be the called from a random change*/
     uint8_t     is_first;
     uint16_t    duration;
     uint16_t    transition;
+    /*Set when the startup jobs that fill std and color are done*/
+    shared_future<void> std_ready;
+    shared_future<void> color_ready;
 } pattern;
 
+inline bool pattern_ready(const pattern *pat)
+{
+    return future_ready(pat->std_ready) && future_ready(pat->color_ready);
+}
+
+/*Everything the keyboard can change*/
+typedef struct {
+    double      count_A;
+    double      count_B;
+    uint8_t     o_show_type;
+    uint8_t     fake_mode;
+    uint8_t     pause_mode;
+    uint8_t     shift_on;
+    uint8_t     white_noise_mode;
+    uint16_t    fake_count;
+} controls;
+
+/*All of the random state, see next_random and getRandom*/
+#define RANDOM_MAX  0x7FFFFFFF
+typedef struct {
+    uint64_t    s;
+    double      z1;         // the second box-muller value, returned by the next getRandom
+    uint8_t     generate;
+} random_state;
+
+/*What a restart needs to carry on drawing the same picture. The checksum covers
+  everything from seq to the end of the ring*/
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    reserved;
+    uint32_t    checksum;
+    uint32_t    ring_size;      // PIXELS_PER_RUN*N_BUFFERS
+    uint64_t    seq;            // the slot with the highest valid seq is the newest
+    uint16_t    width;
+    uint16_t    height;
+    uint16_t    cntr;
+    uint16_t    pattern_id;     // index in patterns
+    uint32_t    full_cntr;
+    double      sigma_effect;
+    random_state rng;
+    controls    ctl;
+    pixel       ring[PIXELS_PER_RUN*N_BUFFERS];
+} snapshot;
+
+#define SNAPSHOT_SLOT_SIZE  ALIGN_UP(sizeof(snapshot), SNAPSHOT_SLOT_ALIGN)
+
+/*The render loop fills a buffer that is not busy and hands it over in pending,
+  the writer thread writes it to slot seq%2 of the file and frees it again*/
+typedef struct {
+    int                 fd;
+    snapshot            *buffers[2];
+    atomic<bool>        busy[2];
+    atomic<int8_t>      pending;
+    uint64_t            seq;
+} snapshot_writer;
+
+/*A trace is a trace_header followed by trace_records sorted by frame, the count
+  is only written when it changes and holds until the next TRACE_COUNT*/
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    width;
+    uint16_t    height;
+    uint16_t    reserved;
+    uint32_t    seed;
+} trace_header;
+
+enum {
+    TRACE_COUNT     = 0,    // value is count_raw
+    TRACE_KEY_DOWN  = 1,    // value is the scancode
+    TRACE_KEY_UP    = 2,
+    TRACE_QUIT      = 3,
+    TRACE_TICKS     = 4     // value is the ticks run that frame, only written when not 1
+};
+
+typedef struct {
+    uint32_t    frame;
+    uint8_t     type;
+    uint8_t     reserved;
+    uint16_t    value;
+} trace_record;
+
+/*Everything the sampling loop needs that only changes once per frame*/
+typedef struct {
+    double      sigma_effect;
+    double      spread[N_SIGMA_CLASSES];    // hue spread of each sigma class for this frame
+    uint8_t     full_sv[N_SIGMA_CLASSES];   // saturation and value forced to 1
+} frame_uniforms;
+
 typedef struct {
     uint8_t width;
     uint8_t height;
@@ -99,6 +816,26 @@ typedef struct {
     uint8_t *pattern;
 } geometric_form;
 
+/*A run of len stamp pixels starting dx, dy away from the stamp position*/
+typedef struct {
+    int8_t      dy;
+    int8_t      dx;
+    uint8_t     len;
+} stamp_span;
+
+typedef struct {
+    uint32_t    first;      // index in stamp_tables::spans
+    uint32_t    n_spans;
+} sprite;
+
+/*Everything a stamp needs that depends on its form and its age, built from the forms once*/
+typedef struct {
+    vector<stamp_span>  spans;
+    sprite              sprites[N_FORMS][AGE_CLASSES];
+    uint8_t             fade[AGE_CLASSES][256];     // channel value at each age class
+    uint8_t             age_class[N_BUFFERS];       // by age in ticks, 0 is the newest buffer
+} stamp_tables;
+
 static rgb   hsv2rgb(hsv in);
 double getRandom(double mu, double sigma, double min, double max);
 
@@ -117,6 +854,7 @@ void testForm(geometric_form *form)
 
 void createTriangle(uint8_t radius, geometric_form *form)
 {
+    radius = SCALED_RADIUS(radius);
     /* First allocate space to create the pattern */
     form->width = 2*radius + 1;
     form->height = 2*radius + 1;
@@ -134,6 +872,7 @@ void createTriangle(uint8_t radius, geometric_form *form)
 
 void createSquare(uint8_t radius, geometric_form *form)
 {
+    radius = SCALED_RADIUS(radius);
     /* First allocate space to create the pattern */
     form->width = 2*radius + 1;
     form->height = 2*radius + 1;
@@ -145,6 +884,7 @@ void createSquare(uint8_t radius, geometric_form *form)
 
 void createCircle(uint8_t radius, geometric_form *form)
 {
+    radius = SCALED_RADIUS(radius);
     /* First allocate space to create the pattern */
     form->width = 2*radius + 1;
     form->height = 2*radius + 1;
@@ -171,30 +911,131 @@ void createCircle(uint8_t radius, geometric_form *form)
     }
 }
 
-void addGeometricForm(uint8_t *pixels, uint16_t width, uint16_t height, pixel *px, geometric_form *form)
+/*The sprite of a form at one age class, the form scaled around its center and cut into
+  horizontal runs*/
+void build_sprite(const geometric_form *form, double scale, stamp_tables *tables, sprite *out)
 {
-    int32_t start_x = px->x - form->center_x;
-    int32_t start_y = px->y - form->center_y;
-    int32_t pos_x, pos_y, step_y, step_x;
-    uint8_t color[4] = {px->b, px->g, px->r, SDL_ALPHA_OPAQUE};
-    for(step_y = 0; step_y < form->height; step_y++)
+    const int32_t radius = max(form->center_x, form->center_y);
+    const int32_t scaled_radius = lround(radius*scale);
+    out->first = tables->spans.size();
+    for (int32_t dy = -scaled_radius; dy <= scaled_radius; dy++)
     {
-        pos_y = start_y + step_y;
-        if ((pos_y >= 0) && (pos_y < height))
+        int32_t run_start = 0, run_len = 0;
+        for (int32_t dx = -scaled_radius; dx <= scaled_radius + 1; dx++)
         {
-            for(step_x = 0; step_x < form->width; step_x++) 
+            bool set = false;
+            if (dx <= scaled_radius)
+            {
+                /*Nearest pixel of the full size form*/
+                const int32_t src_x = form->center_x + ((scaled_radius > 0) ? lround((double)dx*radius/scaled_radius) : 0);
+                const int32_t src_y = form->center_y + ((scaled_radius > 0) ? lround((double)dy*radius/scaled_radius) : 0);
+                set = (src_x >= 0) && (src_x < form->width) && (src_y >= 0) && (src_y < form->height) &&
+                      form->pattern[src_y*form->width + src_x];
+            }
+            if (set)
             {
-                pos_x = start_x + step_x;
-                if (form->pattern[step_y*form->width + step_x])
+                if (run_len == 0)
                 {
-                    if ((pos_x >= 0) && (pos_x < width))
-                    {
-                        memcpy(&pixels[(width*4*pos_y) + pos_x*4], color, 4);
-                    }
+                    run_start = dx;
                 }
+                run_len++;
+            }
+            else if (run_len > 0)
+            {
+                stamp_span span = {(int8_t)dy, (int8_t)run_start, (uint8_t)run_len};
+                tables->spans.push_back(span);
+                run_len = 0;
             }
         }
     }
+    out->n_spans = tables->spans.size() - out->first;
+}
+
+void build_stamp_tables(const geometric_form *forms, stamp_tables *tables)
+{
+    tables->spans.clear();
+    for (uint8_t a = 0; a < AGE_CLASSES; a++)
+    {
+        /*Class 0 is the form as it is, the last one is the smallest and darkest*/
+        const double t = (AGE_CLASSES > 1) ? (double)a/(AGE_CLASSES - 1) : 0;
+        for (uint8_t f = 0; f < N_FORMS; f++)
+        {
+            build_sprite(&forms[f], 1 - t*(1 - AGE_MIN_SCALE), tables, &tables->sprites[f][a]);
+        }
+        const double intensity = 1 - t*(1 - AGE_MIN_INTENSITY);
+        for (uint16_t v = 0; v < 256; v++)
+        {
+            tables->fade[a][v] = lround(v*intensity);
+        }
+    }
+    for (uint16_t age = 0; age < N_BUFFERS; age++)
+    {
+        tables->age_class[age] = (uint32_t)age*AGE_CLASSES/N_BUFFERS;
+    }
+}
+
+/*One span fill per run of the sprite, color is ARGB8888*/
+void add_stamp(frame_plane frame, const pixel *px, const stamp_span *spans, uint32_t n_spans, uint32_t color)
+{
+    for (uint32_t s = 0; s < n_spans; s++)
+    {
+        const int32_t pos_y = px->y + spans[s].dy;
+        if ((pos_y < 0) || (pos_y >= frame.height))
+        {
+            continue;
+        }
+        const int32_t x0 = max<int32_t>(px->x + spans[s].dx, 0);
+        const int32_t x1 = min<int32_t>(px->x + spans[s].dx + spans[s].len, frame.width);
+        uint32_t *line = (uint32_t*)&frame.data[frame.width*4*pos_y];
+        for (int32_t x = x0; x < x1; x++)
+        {
+            line[x] = color;
+        }
+    }
+}
+
+/*Same as add_stamp, but writes the palette index of the stamp*/
+void add_stamp_indexed(index_plane frame, const pixel *px, const stamp_span *spans, uint32_t n_spans, uint16_t index)
+{
+    for (uint32_t s = 0; s < n_spans; s++)
+    {
+        const int32_t pos_y = px->y + spans[s].dy;
+        if ((pos_y < 0) || (pos_y >= frame.height))
+        {
+            continue;
+        }
+        const int32_t x0 = max<int32_t>(px->x + spans[s].dx, 0);
+        const int32_t x1 = min<int32_t>(px->x + spans[s].dx + spans[s].len, frame.width);
+        uint16_t *line = &frame.data[frame.width*pos_y];
+        for (int32_t x = x0; x < x1; x++)
+        {
+            line[x] = index;
+        }
+    }
+}
+
+/*Palette entries of one ring buffer, faded to the age class the buffer is in*/
+void bake_palette(uint32_t *palette, const pixel *pixels, uint16_t buffer, const uint8_t *fade)
+{
+    for (uint16_t i = 0; i < PIXELS_PER_RUN; i++)
+    {
+        const pixel *px = &pixels[PIXELS_PER_RUN*buffer + i];
+        palette[1 + PIXELS_PER_RUN*buffer + i] = 0xFF000000 | (fade[px->r] << 16) | (fade[px->g] << 8) | fade[px->b];
+    }
+}
+
+/*Single pass from palette indexes to ARGB8888, dst_pitch is in bytes as SDL gives it*/
+void expand_palette(index_plane frame, const uint32_t *palette, uint8_t *dst, int dst_pitch)
+{
+    for (uint16_t y = 0; y < frame.height; y++)
+    {
+        const uint16_t *src = &frame.data[frame.width*y];
+        uint32_t *line = (uint32_t*)(dst + dst_pitch*y);
+        for (uint16_t x = 0; x < frame.width; x++)
+        {
+            line[x] = palette[src[x]];
+        }
+    }
 }
 
 /*This function converts a color described in the HSV format to RGB format*/
@@ -256,22 +1097,43 @@ rgb hsv2rgb(hsv in)
     return out;     
 }
 
-/*This function return a constrained random value with normal distribution*/
-/*It uses box-muller to convert from the constrained uniform distribution of the rand() function*/
-double getRandom(double mu, double sigma, double min, double max)
+static random_state rng;
+
+/*Random numbers come from a xorshift64* generator instead of rand(), so all of the
+  random state, the spare box-muller value of getRandom included, can be snapshotted*/
+uint32_t next_random()
 {
-    static const double epsilon = numeric_limits<double>::min();
-    static double z1;
-	static bool generate;
-	generate = !generate;
-    z1 = z1 * sigma + mu;
-	if ((!generate)) 
-    {
-        if ((z1 <= max) && (z1 >= min))
+    rng.s ^= rng.s >> 12;
+    rng.s ^= rng.s << 25;
+    rng.s ^= rng.s >> 27;
+    return (uint32_t)((rng.s*0x2545F4914F6CDD1DULL) >> 33);
+}
+
+void seed_random(uint32_t seed)
+{
+    /*splitmix64 of the seed, xorshift never leaves 0*/
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    rng.s = (z ^ (z >> 31)) | 1;
+    rng.z1 = 0;
+    rng.generate = 0;
+}
+
+/*This function return a constrained random value with normal distribution*/
+/*It uses box-muller to convert from the constrained uniform distribution of next_random*/
+double getRandom(double mu, double sigma, double min, double max)
+{
+    static const double epsilon = numeric_limits<double>::min();
+	rng.generate = !rng.generate;
+    rng.z1 = rng.z1 * sigma + mu;
+	if ((!rng.generate)) 
+    {
+        if ((rng.z1 <= max) && (rng.z1 >= min))
         {
-	        return z1;
+	        return rng.z1;
         } else {
-	        generate = !generate;
+	        rng.generate = !rng.generate;
         }
     }
     double z0;
@@ -280,12 +1142,12 @@ double getRandom(double mu, double sigma, double min, double max)
     {
 	    do
 	    {
-	      u1 = rand() * (1.0 / RAND_MAX);
-	      u2 = rand() * (1.0 / RAND_MAX);
+	      u1 = next_random() * (1.0 / RANDOM_MAX);
+	      u2 = next_random() * (1.0 / RANDOM_MAX);
 	    }
 	    while ( u1 <= epsilon );
         z0 = sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
-        z1 = sqrt(-2.0 * log(u1)) * sin(2 * M_PI * u2);
+        rng.z1 = sqrt(-2.0 * log(u1)) * sin(2 * M_PI * u2);
         z0 = z0 * sigma + mu;
     }
     while ( (z0 > max) || (z0 < min));
@@ -326,6 +1188,876 @@ double getPeopleCount(double a, double b)
     return getPeopleCount(a, b, getPeopleCount());
 }
 
+/*Moving window over the counter log. start is the sample in effect at the start of the
+  window, it only moves forward, and max_window holds the samples from start on that
+  are larger than every later one, so both queries are O(1) amortized per frame*/
+typedef struct {
+    const counter_log   *log;
+    int64_t             window_ms;
+    uint64_t            start;
+    uint64_t            seen;           // samples already pushed into max_window
+    deque<uint64_t>     max_window;
+} counter_window;
+
+void open_counter_window(counter_window *window, int64_t window_ms)
+{
+    window->log = map_counter_log(COUNTER_LOG_FILE, false);
+    window->window_ms = window_ms;
+    window->start = 0;
+    window->seen = 0;
+    window->max_window.clear();
+}
+
+/*log goes back to NULL, the next open_counter_window maps the file again*/
+void close_counter_window(counter_window *window)
+{
+    if (window->log != NULL)
+    {
+        unmap_counter_log(window->log);
+    }
+    window->log = NULL;
+    window->start = 0;
+    window->seen = 0;
+    window->max_window.clear();
+}
+
+/*Brings the window up to now, false while the log has no samples. A log that was
+  reset under us is closed, the indexes of the window are past its end*/
+bool update_counter_window(counter_window *window, int64_t now_ms)
+{
+    const uint64_t n = counter_log_size(window->log);
+    if (n < window->seen)
+    {
+        close_counter_window(window);
+        return false;
+    }
+    if (n == 0)
+    {
+        return false;
+    }
+    /*Samples that went round the ring are gone*/
+    const uint64_t oldest = (n > COUNTER_LOG_CAPACITY) ? n - COUNTER_LOG_CAPACITY : 0;
+    window->start = max(window->start, oldest);
+    window->seen = max(window->seen, oldest);
+    while (!window->max_window.empty() && (window->max_window.front() < oldest))
+    {
+        window->max_window.pop_front();
+    }
+
+    for (; window->seen < n; window->seen++)
+    {
+        const uint32_t count = counter_log_sample(window->log, window->seen)->count;
+        while (!window->max_window.empty() &&
+               (counter_log_sample(window->log, window->max_window.back())->count <= count))
+        {
+            window->max_window.pop_back();
+        }
+        window->max_window.push_back(window->seen);
+    }
+
+    const int64_t window_begin = now_ms - window->window_ms;
+    while ((window->start + 1 < n) && (counter_log_sample(window->log, window->start + 1)->time_ms <= window_begin))
+    {
+        window->start++;
+    }
+    while (window->max_window.front() < window->start)
+    {
+        window->max_window.pop_front();
+    }
+    return true;
+}
+
+/*Time weighted, each count counts for as long as it held*/
+double counter_window_average(const counter_window *window, int64_t now_ms)
+{
+    const uint64_t n = counter_log_size(window->log);
+    const counter_sample *first = counter_log_sample(window->log, window->start);
+    const counter_sample *last = counter_log_sample(window->log, n - 1);
+    const int64_t window_begin = max(now_ms - window->window_ms, first->time_ms);
+    const int64_t window_end = max(now_ms, last->time_ms);
+    if (window_end <= window_begin)
+    {
+        return last->count;
+    }
+    const double area_begin = first->area + (double)first->count*(window_begin - first->time_ms);
+    const double area_end = last->area + (double)last->count*(window_end - last->time_ms);
+    return (area_end - area_begin)/(window_end - window_begin);
+}
+
+uint32_t counter_window_max(const counter_window *window)
+{
+    return counter_log_sample(window->log, window->max_window.front())->count;
+}
+
+/*False when the reader stopped writing the log or something else writes counter.bin*/
+bool counter_window_current(const counter_window *window, int64_t now_ms)
+{
+    const counter_sample *last = counter_log_sample(window->log, counter_log_size(window->log) - 1);
+    if (last->time_ms < now_ms - window->window_ms)
+    {
+        return false;
+    }
+    struct stat st;
+    if (stat("counter.bin", &st) == 0)
+    {
+        const int64_t bin_ms = (int64_t)st.st_mtim.tv_sec*1000 + st.st_mtim.tv_nsec/1000000;
+        if (bin_ms > last->time_ms + COUNT_BIN_SLACK_MS)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*Sigma of each class and fraction of each S/V percentage, filled by init_sample_tables*/
+static double class_sigma[N_SIGMA_CLASSES];
+static double percent_fraction[101];
+
+/*Class 0 is an exact zero sigma, the others are log2 spaced from 1*/
+uint8_t sigma_to_class(double sigma)
+{
+    if (sigma <= 0)
+    {
+        return 0;
+    }
+    if (sigma < 1)
+    {
+        return 1;
+    }
+    long sigma_class = 1 + lround(log2(sigma)*SIGMA_CLASS_STEPS);
+    if (sigma_class > N_SIGMA_CLASSES - 1)
+    {
+        sigma_class = N_SIGMA_CLASSES - 1;
+    }
+    return sigma_class;
+}
+
+void init_sample_tables()
+{
+    class_sigma[0] = 0;
+    for (uint16_t i = 1; i < N_SIGMA_CLASSES; i++)
+    {
+        class_sigma[i] = exp2((i - 1)/((double)SIGMA_CLASS_STEPS));
+    }
+    for (uint8_t i = 0; i <= 100; i++)
+    {
+        percent_fraction[i] = i/100.0;
+    }
+}
+
+/*sigma_effect as a function of the position in the pattern, it goes from 1000 down to 1
+  in the first transition frames and back up to 1000 in the last transition ones*/
+double sigma_effect_at(uint32_t full_cntr, uint16_t duration, uint16_t transition)
+{
+    if (transition == 0)
+    {
+        return 1;
+    }
+    uint32_t step = (full_cntr%duration) + 1;
+    double sigma_effect = 1;
+    if (step < transition)
+    {
+        sigma_effect = 1000 - (999.0*step)/transition;
+    }
+    else if (step > (uint32_t)(duration - transition))
+    {
+        sigma_effect = 1 + (999.0*(step - (duration - transition)))/transition;
+    }
+    if (sigma_effect < 1)
+    {
+        sigma_effect = 1;
+    }
+    return sigma_effect;
+}
+
+void update_frame_uniforms(frame_uniforms *uniforms, double sigma_effect)
+{
+    uniforms->sigma_effect = sigma_effect;
+    double scale = sqrt(sigma_effect);
+    for (uint16_t i = 0; i < N_SIGMA_CLASSES; i++)
+    {
+        double spread = class_sigma[i]*scale;
+        if (spread > 1000)
+        {
+            spread = 1000;
+        }
+        uniforms->spread[i] = spread;
+        uniforms->full_sv[i] = (spread > 100);
+    }
+}
+
+/*Vose's alias method, O(RENDER_WIDTH*RENDER_HEIGHT) once per plane so every draw is O(1)*/
+void build_alias_table(std_plane *plane)
+{
+    plane->weighted = 0;
+    if ((plane->alias == NULL) || (plane->data == NULL))
+    {
+        return;
+    }
+    const uint32_t n = (uint32_t)plane->width*plane->height;
+
+    double class_weight[N_SIGMA_CLASSES];
+    uint32_t class_count[N_SIGMA_CLASSES] = {0};
+    for (uint16_t c = 0; c < N_SIGMA_CLASSES; c++)
+    {
+        class_weight[c] = pow(1 + class_sigma[c], -IMPORTANCE_EXPONENT);
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        class_count[plane->data[i]]++;
+    }
+    double max_weight = 0, total = 0;
+    uint16_t n_used = 0;
+    for (uint16_t c = 0; c < N_SIGMA_CLASSES; c++)
+    {
+        if (class_count[c])
+        {
+            max_weight = max(max_weight, class_weight[c]);
+            n_used++;
+        }
+    }
+    if (n_used < 2)
+    {
+        return;
+    }
+    for (uint16_t c = 0; c < N_SIGMA_CLASSES; c++)
+    {
+        class_weight[c] = max(class_weight[c]/max_weight, IMPORTANCE_FLOOR);
+        total += class_weight[c]*class_count[c];
+    }
+
+    /*scaled[i] is the weight of pixel i times n over the total, the average is 1*/
+    vector<double> scaled(n);
+    vector<uint32_t> small, large;
+    small.reserve(n);
+    large.reserve(n);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        scaled[i] = class_weight[plane->data[i]]*n/total;
+        if (scaled[i] < 1)
+        {
+            small.push_back(i);
+        }
+        else
+        {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty())
+    {
+        uint32_t s = small.back();
+        uint32_t l = large.back();
+        small.pop_back();
+        plane->alias[s].prob = (uint32_t)(scaled[s]*RANDOM_MAX);
+        plane->alias[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    /*What is left is 1 up to rounding*/
+    for (uint32_t i : large)
+    {
+        plane->alias[i].prob = RANDOM_MAX;
+        plane->alias[i].alias = i;
+    }
+    for (uint32_t i : small)
+    {
+        plane->alias[i].prob = RANDOM_MAX;
+        plane->alias[i].alias = i;
+    }
+    plane->weighted = 1;
+}
+
+/*Returns y*width + x of the next stamp*/
+inline uint32_t sample_position(const std_plane *plane)
+{
+    if (!plane->weighted)
+    {
+        const uint32_t x = next_random() % plane->width;
+        const uint32_t y = next_random() % plane->height;
+        return y*plane->width + x;
+    }
+    const uint32_t i = next_random() % ((uint32_t)plane->width*plane->height);
+    const alias_entry entry = plane->alias[i];
+    return (next_random() <= entry.prob) ? i : entry.alias;
+}
+
+/*This is the keyboard handling of the render loop, also used to replay traces*/
+void handle_key(controls *ctl, uint32_t type, uint16_t scancode)
+{
+    if (SDL_KEYDOWN == type && 225 == scancode )
+    {
+        ctl->shift_on = 1;
+    }
+    else if (SDL_KEYUP == type && 225 == scancode )
+    {
+        ctl->shift_on = 0;
+    }
+    else if (SDL_KEYDOWN == type && 4 == scancode )
+    {
+        if (ctl->shift_on)
+        {
+            ctl->count_A += 0.01;
+        }
+        else
+        {
+            ctl->count_A -= 0.01;
+            if (ctl->count_A < 0)
+            {
+                ctl->count_A = 0;
+            }
+        }
+    }
+    else if (SDL_KEYDOWN == type && 5 == scancode )
+    {
+        if (ctl->shift_on)
+        {
+            ctl->count_B += 0.25;
+        }
+        else
+        {
+            ctl->count_B -= 0.25;
+            if (ctl->count_B < 0)
+            {
+                ctl->count_B = 0;
+            }
+        }
+    }
+    else if (SDL_KEYDOWN == type && 18 == scancode )
+    {
+        ctl->o_show_type += 1;
+    }
+    else if (SDL_KEYDOWN == type && 9 == scancode )
+    {
+        ctl->fake_mode += 1;
+    }
+    else if (SDL_KEYDOWN == type && (87 == scancode || 46 == scancode))
+    {
+        ctl->fake_count += 1;
+    }
+    else if (SDL_KEYDOWN == type && (86 == scancode || 45 == scancode))
+    {
+        if (ctl->fake_count > 0)
+        {
+            ctl->fake_count -= 1;
+        }
+    }
+    else if (SDL_KEYDOWN == type && 19 == scancode )
+    {
+        ctl->pause_mode += 1;
+    }
+    else if (SDL_KEYDOWN == type && 22 == scancode )
+    {
+        ctl->white_noise_mode += 1;
+    }
+}
+
+FILE *open_trace_record(string filename, uint32_t seed)
+{
+    FILE *trace = fopen(filename.c_str(), "wb");
+    if (trace == NULL)
+    {
+        return NULL;
+    }
+    trace_header header = {TRACE_MAGIC, TRACE_VERSION, RENDER_WIDTH, RENDER_HEIGHT, 0, seed};
+    fwrite(&header, sizeof(header), 1, trace);
+    return trace;
+}
+
+/*Goes through the stdio buffer, the render loop never waits on the disk here*/
+void write_trace_record(FILE *trace, uint32_t frame, uint8_t type, uint16_t value)
+{
+    trace_record record = {frame, type, 0, value};
+    fwrite(&record, sizeof(record), 1, trace);
+}
+
+/*SIGINT and SIGTERM end the loop like ESC does, so a recording killed on the kiosk
+  still gets its TRACE_QUIT and is closed*/
+static volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+bool load_trace(string filename, uint32_t *seed, vector<trace_record> *records)
+{
+    ifstream myfile;
+    myfile.open(filename, ios::in | ios::binary);
+    trace_header header;
+    myfile.read((char*)&header, sizeof(header));
+    if (!myfile.good() || (header.magic != TRACE_MAGIC) || (header.version != TRACE_VERSION))
+    {
+        return false;
+    }
+    if ((header.width != RENDER_WIDTH) || (header.height != RENDER_HEIGHT))
+    {
+        cout << "Trace was recorded at " << header.width << "x" << header.height << ", replaying at " << RENDER_WIDTH << "x" << RENDER_HEIGHT << endl;
+    }
+    *seed = header.seed;
+    trace_record record;
+    while (myfile.read((char*)&record, sizeof(record)))
+    {
+        records->push_back(record);
+    }
+    return true;
+}
+
+/*--rt-cpu, --rt-prio, --rt-policy, --nice and --mlock, everything is optional and
+  applied to the render thread only, the helper threads are started before it*/
+typedef struct {
+    const char  *cpu;           // as given to --rt-cpu, NULL leaves the affinity alone
+    int         priority;       // 0 leaves the scheduler alone
+    int         policy;         // SCHED_FIFO or SCHED_RR
+    int         nice_level;     // also the fallback when the priority is not allowed
+    bool        set_nice;
+    bool        lock_memory;
+} rt_profile;
+
+/*Every setting reports what it got, without privileges the render thread just keeps
+  running as it would have*/
+void apply_rt_profile(const rt_profile *profile, const frame_arena &arena)
+{
+    if (profile->cpu != NULL)
+    {
+        /*CPU_SET past CPU_SETSIZE is undefined, and a typo must not pin to cpu 0*/
+        char *end;
+        errno = 0;
+        const long cpu = strtol(profile->cpu, &end, 10);
+        if ((end == profile->cpu) || (*end != '\0') || (errno != 0) || (cpu < 0) || (cpu >= CPU_SETSIZE))
+        {
+            cout << "Realtime: invalid cpu " << profile->cpu << ", not pinned" << endl;
+        }
+        else
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (err == 0)
+            {
+                cout << "Realtime: render thread pinned to cpu " << cpu << endl;
+            }
+            else
+            {
+                cout << "Realtime: pinning to cpu " << cpu << " failed (" << strerror(err) << "), not pinned" << endl;
+            }
+        }
+    }
+
+    bool need_nice = profile->set_nice;
+    if (profile->priority > 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = min(max(profile->priority, sched_get_priority_min(profile->policy)),
+                                   sched_get_priority_max(profile->policy));
+        const char *policy_name = (profile->policy == SCHED_RR) ? "SCHED_RR" : "SCHED_FIFO";
+        const int err = pthread_setschedparam(pthread_self(), profile->policy, &param);
+        if (err == 0)
+        {
+            cout << "Realtime: " << policy_name << " priority " << param.sched_priority << endl;
+            need_nice = false;
+        }
+        else
+        {
+            cout << "Realtime: " << policy_name << " priority " << param.sched_priority << " failed (" << strerror(err)
+                 << "), " << (profile->set_nice ? "trying the nice level" : "staying SCHED_OTHER") << endl;
+        }
+    }
+    if (need_nice)
+    {
+        /*On Linux the nice level of a thread id is the level of that thread only*/
+        if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), profile->nice_level) == 0)
+        {
+            cout << "Realtime: nice " << profile->nice_level << endl;
+        }
+        else
+        {
+            cout << "Realtime: nice " << profile->nice_level << " failed (" << strerror(errno) << "), nice "
+                 << getpriority(PRIO_PROCESS, syscall(SYS_gettid)) << endl;
+        }
+    }
+
+    if (profile->lock_memory)
+    {
+        if (mlock(arena.base, arena.size) == 0)
+        {
+            cout << "Realtime: " << arena.size/1024 << " KiB of arena locked in memory" << endl;
+        }
+        else
+        {
+            struct rlimit limit;
+            getrlimit(RLIMIT_MEMLOCK, &limit);
+            cout << "Realtime: locking " << arena.size/1024 << " KiB of arena failed (" << strerror(errno)
+                 << ", RLIMIT_MEMLOCK " << ((limit.rlim_cur == RLIM_INFINITY) ? string("unlimited") : to_string(limit.rlim_cur/1024) + " KiB")
+                 << "), not locked" << endl;
+        }
+    }
+}
+
+/*FNV-1a*/
+uint32_t snapshot_checksum(const snapshot *snap)
+{
+    const uint8_t *data = (const uint8_t*)&snap->seq;
+    const size_t size = sizeof(snapshot) - offsetof(snapshot, seq);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i])*16777619u;
+    }
+    return hash;
+}
+
+bool snapshot_valid(const snapshot *snap)
+{
+    return (snap->magic == SNAPSHOT_MAGIC) && (snap->version == SNAPSHOT_VERSION) &&
+           (snap->ring_size == PIXELS_PER_RUN*N_BUFFERS) &&
+           (snap->width == RENDER_WIDTH) && (snap->height == RENDER_HEIGHT) &&
+           (snap->pattern_id < N_PATTERNS) && (snap->cntr <= N_BUFFERS) &&
+           (snap->checksum == snapshot_checksum(snap));
+}
+
+/*Copies the newest complete slot of the file into snap, a slot torn by a crash
+  in the middle of its write fails the checksum and the other one is used*/
+bool load_snapshot(const char *filename, snapshot *snap)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < 2*SNAPSHOT_SLOT_SIZE))
+    {
+        close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, 2*SNAPSHOT_SLOT_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        return false;
+    }
+    const snapshot *best = NULL;
+    for (uint8_t slot = 0; slot < 2; slot++)
+    {
+        const snapshot *candidate = (const snapshot*)((uint8_t*)mem + slot*SNAPSHOT_SLOT_SIZE);
+        if (snapshot_valid(candidate) && ((best == NULL) || (candidate->seq > best->seq)))
+        {
+            best = candidate;
+        }
+    }
+    if (best != NULL)
+    {
+        memcpy(snap, best, sizeof(snapshot));
+    }
+    munmap(mem, 2*SNAPSHOT_SLOT_SIZE);
+    return best != NULL;
+}
+
+bool open_snapshot_writer(snapshot_writer *writer, const char *filename)
+{
+    writer->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (writer->fd < 0)
+    {
+        return false;
+    }
+    if (ftruncate(writer->fd, 2*SNAPSHOT_SLOT_SIZE) != 0)
+    {
+        close(writer->fd);
+        writer->fd = -1;
+        return false;
+    }
+    writer->busy[0] = false;
+    writer->busy[1] = false;
+    writer->pending = -1;
+    return true;
+}
+
+/*Runs on the render thread and never waits, while the writer has not picked up
+  the previous snapshot this one is skipped*/
+void take_snapshot(snapshot_writer *writer, const pixel *pixels, uint16_t cntr, uint32_t full_cntr,
+                   uint16_t pattern_id, double sigma_effect, const controls *ctl)
+{
+    if (writer->pending.load() >= 0)
+    {
+        return;
+    }
+    int8_t b = !writer->busy[0] ? 0 : 1;
+    snapshot *snap = writer->buffers[b];
+    snap->magic = SNAPSHOT_MAGIC;
+    snap->version = SNAPSHOT_VERSION;
+    snap->pattern_id = pattern_id;
+    snap->ring_size = PIXELS_PER_RUN*N_BUFFERS;
+    snap->seq = ++writer->seq;
+    snap->width = RENDER_WIDTH;
+    snap->height = RENDER_HEIGHT;
+    snap->cntr = cntr;
+    snap->reserved = 0;
+    snap->full_cntr = full_cntr;
+    snap->sigma_effect = sigma_effect;
+    snap->rng = rng;
+    snap->ctl = *ctl;
+    memcpy(snap->ring, pixels, sizeof(snap->ring));
+    writer->busy[b] = true;
+    writer->pending = b;
+}
+
+void write_snapshots(snapshot_writer *writer, atomic<bool> *running)
+{
+    while (running->load())
+    {
+        this_thread::sleep_for(chrono::milliseconds(SNAPSHOT_POLL_MS));
+        int8_t b = writer->pending.exchange(-1);
+        if (b < 0)
+        {
+            continue;
+        }
+        snapshot *snap = writer->buffers[b];
+        snap->checksum = snapshot_checksum(snap);
+        const off_t offset = (snap->seq % 2)*SNAPSHOT_SLOT_SIZE;
+        if (pwrite(writer->fd, snap, sizeof(snapshot), offset) != (ssize_t)sizeof(snapshot))
+        {
+            LOG(LOG_ERROR, "Problems writing the snapshot %.0f", (double)snap->seq);
+        }
+        writer->busy[b] = false;
+    }
+}
+
+/*Prints the frame time distribution and optionally writes every frame time to a file*/
+void report_frame_times(vector<float> &times_ms, string filename)
+{
+    if (times_ms.empty())
+    {
+        return;
+    }
+    if (!filename.empty())
+    {
+        ofstream times_file(filename);
+        for (float t : times_ms)
+        {
+            times_file << t << "\n";
+        }
+    }
+    double total = 0;
+    for (float t : times_ms)
+    {
+        total += t;
+    }
+    vector<float> sorted = times_ms;
+    sort(sorted.begin(), sorted.end());
+    const size_t n = sorted.size();
+    cout << "Frames: " << n << " mean: " << total/n << "ms"
+         << " p50: " << sorted[n*50/100] << "ms"
+         << " p90: " << sorted[n*90/100] << "ms"
+         << " p99: " << sorted[n*99/100] << "ms"
+         << " p999: " << sorted[n*999/1000] << "ms"
+         << " max: " << sorted[n - 1] << "ms" << endl;
+}
+
+/*Builds the working plane of a pattern, done once per pattern change*/
+void fill_cell_plane(cell_plane *cells, std_plane std, color_plane color)
+{
+    for (uint32_t y = 0; y < cells->height; y++)
+    {
+        for (uint32_t x = 0; x < cells->width; x++)
+        {
+            const uint32_t src = y*cells->width + x;
+            cell c = {std.data[src], color.data[src*3 + 0], color.data[src*3 + 1], color.data[src*3 + 2]};
+            set_cell(cells, x, y, c);
+        }
+    }
+}
+
+/*This creates a soft pattern change, by applying the pattern slowly on top of the old one*/
+void blend_cell_plane(cell_plane *cells, std_plane std, color_plane color)
+{
+    for (uint32_t y = 0; y < cells->height; y++)
+    {
+        for (uint32_t x = 0; x < cells->width; x++)
+        {
+            const uint32_t src = y*cells->width + x;
+            cell c = get_cell(cells, x, y);
+            c.sigma_class = (c.sigma_class*9 + std.data[src] + 5)/10;
+            c.h = c.h*0.95 + color.data[src*3 + 0]*0.05;
+            c.s = c.s*0.95 + color.data[src*3 + 1]*0.05;
+            c.v = c.v*0.95 + color.data[src*3 + 2]*0.05;
+            set_cell(cells, x, y, c);
+        }
+    }
+}
+
+/*Counts hardware events of this thread, returns -1 when perf is not available*/
+int open_perf_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*--bench-layout: random sample lookups in width x height planes, split row major planes
+  against the tiled cells, with and without sorting the samples by tile first*/
+void layout_bench(uint16_t width, uint16_t height)
+{
+    const uint32_t samples_per_frame = 1000, frames = 20000;
+    const uint32_t tiles_per_row = ALIGN_UP(width, TILE_SIZE) >> TILE_SHIFT;
+    frame_arena arena(width*height*(sizeof(double) + sizeof(uint8_t) + 3*sizeof(uint16_t)) + tiled_size(width, height) + 4*ARENA_ALIGN);
+    double *sigma_double = (double*)arena.alloc(width*height*sizeof(double));
+    uint8_t *sigma_class = (uint8_t*)arena.alloc(width*height*sizeof(uint8_t));
+    uint16_t *color = (uint16_t*)arena.alloc(width*height*3*sizeof(uint16_t));
+    cell *cells = (cell*)arena.alloc(tiled_size(width, height));
+    if ((sigma_double == NULL) || (sigma_class == NULL) || (color == NULL) || (cells == NULL))
+    {
+        cout << "Problems allocating the benchmark planes" << endl;
+        return;
+    }
+    for (uint32_t i = 0; i < (uint32_t)width*height; i++)
+    {
+        sigma_double[i] = i%7;
+        sigma_class[i] = i%7;
+        color[i*3 + 0] = i%360;
+        color[i*3 + 1] = i%101;
+        color[i*3 + 2] = i%99;
+    }
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const uint32_t pos = y*width + x;
+            cell c = {sigma_class[pos], color[pos*3 + 0], color[pos*3 + 1], color[pos*3 + 2]};
+            cells[tile_offset(tiles_per_row, x, y)] = c;
+        }
+    }
+
+    vector<uint32_t> xs(samples_per_frame), ys(samples_per_frame);
+    vector<uint64_t> order(samples_per_frame);
+    vector<uint32_t> out(samples_per_frame);
+    int misses_fd = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int l1_fd = open_perf_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (misses_fd < 0)
+    {
+        cout << "perf_event_open not available (perf_event_paranoid or no PMU), only timing" << endl;
+    }
+    cout << width << "x" << height << ":" << endl;
+    const char *names[] = {"double sigma + uint16 hsv, row major", "uint8 class + uint16 hsv, row major",
+                           "packed cells, tiled", "packed cells, tiled, sorted by tile"};
+    for (uint8_t layout = 0; layout < 4; layout++)
+    {
+        seed_random(1);
+        uint64_t checksum = 0;
+        double seconds = 0;
+        if (misses_fd >= 0)
+        {
+            ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        if (l1_fd >= 0)
+        {
+            ioctl(l1_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(l1_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        for (uint32_t frame = 0; frame < frames; frame++)
+        {
+            /*Drawing the positions is the same for all layouts and stays out of the timing*/
+            for (uint32_t i = 0; i < samples_per_frame; i++)
+            {
+                xs[i] = next_random() % width;
+                ys[i] = next_random() % height;
+            }
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            if (layout == 0)
+            {
+                for (uint32_t i = 0; i < samples_per_frame; i++)
+                {
+                    const uint32_t pos = ys[i]*width + xs[i];
+                    out[i] = (uint32_t)sigma_double[pos] + color[pos*3 + 0] + color[pos*3 + 1] + color[pos*3 + 2];
+                }
+            }
+            else if (layout == 1)
+            {
+                for (uint32_t i = 0; i < samples_per_frame; i++)
+                {
+                    const uint32_t pos = ys[i]*width + xs[i];
+                    out[i] = sigma_class[pos] + color[pos*3 + 0] + color[pos*3 + 1] + color[pos*3 + 2];
+                }
+            }
+            else if (layout == 2)
+            {
+                for (uint32_t i = 0; i < samples_per_frame; i++)
+                {
+                    const cell c = cells[tile_offset(tiles_per_row, xs[i], ys[i])];
+                    out[i] = c.sigma_class + c.h + c.s + c.v;
+                }
+            }
+            else
+            {
+                for (uint32_t i = 0; i < samples_per_frame; i++)
+                {
+                    order[i] = ((uint64_t)tile_offset(tiles_per_row, xs[i], ys[i]) << 16) | i;
+                }
+                sort(order.begin(), order.end());
+                for (uint32_t k = 0; k < samples_per_frame; k++)
+                {
+                    const cell c = cells[order[k] >> 16];
+                    out[order[k] & 0xFFFF] = c.sigma_class + c.h + c.s + c.v;
+                }
+            }
+            seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            for (uint32_t i = 0; i < samples_per_frame; i++)
+            {
+                checksum += out[i];
+            }
+        }
+        long long misses = -1, l1_misses = -1;
+        if (misses_fd >= 0)
+        {
+            ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(misses_fd, &misses, sizeof(misses)) != sizeof(misses))
+            {
+                misses = -1;
+            }
+        }
+        if (l1_fd >= 0)
+        {
+            ioctl(l1_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(l1_fd, &l1_misses, sizeof(l1_misses)) != sizeof(l1_misses))
+            {
+                l1_misses = -1;
+            }
+        }
+        const double n = (double)samples_per_frame*frames;
+        cout << "  " << names[layout] << ": " << seconds*1e9/n << " ns/sample";
+        if (misses >= 0)
+        {
+            cout << ", " << misses/n << " LLC misses/sample";
+        }
+        if (l1_misses >= 0)
+        {
+            cout << ", " << l1_misses/n << " L1D misses/sample";
+        }
+        cout << " (checksum " << checksum << ")" << endl;
+    }
+    if (misses_fd >= 0)
+    {
+        close(misses_fd);
+    }
+    if (l1_fd >= 0)
+    {
+        close(l1_fd);
+    }
+}
 
 int get_file_size(string filename) // path to file
 {
@@ -337,40 +2069,42 @@ int get_file_size(string filename) // path to file
     return size;
 }
 
-void create_flag(uint16_t *color_list, uint8_t color_len, uint16_t *colors)
+void create_flag(uint16_t *color_list, uint8_t color_len, color_plane plane)
 {
-    uint16_t color_lines = HEIGHT/color_len;
-    for(uint16_t y = 0; y < HEIGHT; y++)
+    uint16_t *colors = plane.data;
+    uint16_t color_lines = plane.height/color_len;
+    for(uint16_t y = 0; y < plane.height; y++)
     {
-        for(uint16_t x = 0; x < WIDTH; x++)
+        for(uint16_t x = 0; x < plane.width; x++)
         {
             uint8_t color_pos = y/color_lines;
             if (color_pos >= color_len)
             {
                 color_pos = color_len - 1;
             }
-            colors[(y*WIDTH + x)*3 + 0] = color_list[color_pos*3 + 0];
-            colors[(y*WIDTH + x)*3 + 1] = color_list[color_pos*3 + 1];
-            colors[(y*WIDTH + x)*3 + 2] = color_list[color_pos*3 + 2];
+            colors[(y*plane.width + x)*3 + 0] = color_list[color_pos*3 + 0];
+            colors[(y*plane.width + x)*3 + 1] = color_list[color_pos*3 + 1];
+            colors[(y*plane.width + x)*3 + 2] = color_list[color_pos*3 + 2];
         }
     }
 }
 
-void create_rainbow(uint16_t *color, uint16_t offset)
+void create_rainbow(color_plane plane, uint16_t offset)
 {
-    for (uint16_t y = 0; y < HEIGHT; y++)
+    uint16_t *color = plane.data;
+    for (uint16_t y = 0; y < plane.height; y++)
     {
-        for(uint16_t x = 0; x < WIDTH; x++)
+        for(uint16_t x = 0; x < plane.width; x++)
         {
-            color[(y*WIDTH + x)*3 + 0] = ((int)(360*(((double)x)/WIDTH)) + offset)%360; 
-            color[(y*WIDTH + x)*3 + 1] = 100;
-            color[(y*WIDTH + x)*3 + 2] = 100;
+            color[(y*plane.width + x)*3 + 0] = ((int)(360*(((double)x)/plane.width)) + offset)%360; 
+            color[(y*plane.width + x)*3 + 1] = 100;
+            color[(y*plane.width + x)*3 + 2] = 100;
         }
     }
 
 }
 
-pattern createPattern(double *sigma, uint16_t *color, uint16_t duration, uint16_t transition)
+pattern createPattern(std_plane sigma, color_plane color, uint16_t duration, uint16_t transition)
 {
     pattern pat;
     pat.std = sigma;
@@ -382,55 +2116,285 @@ pattern createPattern(double *sigma, uint16_t *color, uint16_t duration, uint16_
     return pat;
 }
 
-pattern createPattern(double *sigma, uint16_t *color)
+pattern createPattern(std_plane sigma, color_plane color)
 {
     return createPattern(sigma, color, CHANGE_N, TRANSITION_N);
 }
 
-void load_std(string filename, double *sigmas)
+bool load_std(string filename, std_plane plane)
 {
+    uint8_t *sigmas = plane.data;
     /*Read file to load a pattern
       this file is generatad by running the scripts createImage.py  parseImages.py*/
     ifstream myfile;
-    myfile.open(filename, ios::out | ios::app | ios::binary);
-    uint16_t nlines, ncols;
+    myfile.open(filename, ios::in | ios::binary);
+    uint16_t nlines = 0, ncols = 0;
     char *size_buff = (char*)&ncols;
     myfile.read(size_buff, 2);
     size_buff = (char*)&nlines;
     myfile.read(size_buff, 2);
 
-    for(uint32_t readcntr = 0; readcntr < HEIGHT*WIDTH; readcntr++)
-    {
-        sigmas[readcntr] = 5;
-    }
+    memset(sigmas, sigma_to_class(5), (uint32_t)plane.height*plane.width);
+
+    /*The file is at window resolution, keep the pixel at the corner of each plane pixel*/
+    const uint16_t step_x = WIDTH/plane.width;
+    const uint16_t step_y = HEIGHT/plane.height;
+
+    /*The same sigma repeats along the lines, only take the log when it changes*/
+    uint32_t last_std = 0;
+    uint8_t last_class = sigma_to_class(0);
 
     for(uint16_t nline = 0; nline < nlines; nline++)
     {
         for(uint16_t ncol = 0; ncol < ncols; ncol++)
         {
-            char buff[6];
-            myfile.read(buff, 6);
-
-            uint32_t std;
-            uint16_t hue;
-            memcpy(&std, &buff[0], 4);
-            if (std > 100000)
+            char buff[6];
+            myfile.read(buff, 6);
+
+            uint32_t std;
+            uint16_t hue;
+            memcpy(&std, &buff[0], 4);
+            if (std > 100000)
+            {
+                std = 100000;
+            }
+            memcpy(&hue, &buff[4], 2);
+            uint8_t temp = ((uint8_t *)&hue)[0];
+            ((uint8_t *)&hue)[0] = ((uint8_t *)&hue)[1];
+            ((uint8_t *)&hue)[1] = temp;
+            if ((nline%step_y != 0) || (ncol%step_x != 0) ||
+                (nline/step_y >= plane.height) || (ncol/step_x >= plane.width))
+            {
+                continue;
+            }
+            if (std != last_std)
+            {
+                last_std = std;
+                last_class = sigma_to_class(std);
+            }
+            sigmas[(nline/step_y)*plane.width + ncol/step_x] = last_class;
+        }
+    }
+    /*A file that is still being written by the scripts comes out short*/
+    bool complete = myfile.good();
+    myfile.close();
+    return complete;
+}
+
+/*Startup job of a .res plane. The patterns copied the plane before its alias table
+  was built, so they get the weighted flag here, before the plane is marked ready*/
+void build_std_asset(string filename, std_plane plane, pattern *patterns)
+{
+    load_std(filename, plane);
+    build_alias_table(&plane);
+    for (uint8_t p = 0; p < N_PATTERNS; p++)
+    {
+        if (patterns[p].std.data == plane.data)
+        {
+            patterns[p].std.weighted = plane.weighted;
+        }
+    }
+}
+
+#if HOT_RELOAD
+/*One entry per .res file, each owns two arena planes. The watcher thread decodes
+  a changed file into the spare one and leaves it in pending, the render loop
+  takes it at the next pattern change and gives the old plane back as the spare
+  one pattern change later*/
+typedef struct {
+    const char          *filename;
+    std_plane           slots[2];
+    std_plane           *active;
+    std_plane           *retired;
+    atomic<std_plane*>  pending;
+    atomic<std_plane*>  spare;
+    int64_t             mtime_ns;   // st_mtim, a rewrite within the same second still counts
+    off_t               size;
+    shared_future<void> loaded;     // the startup load of slots[0]
+} std_asset;
+
+bool get_file_stamp(string filename, int64_t *mtime_ns, off_t *size)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+    return true;
+}
+
+void watch_std_assets(std_asset *assets, uint8_t n_assets, atomic<bool> *running)
+{
+    while (running->load())
+    {
+        this_thread::sleep_for(chrono::milliseconds(HOT_RELOAD_PERIOD_MS));
+        for (uint8_t i = 0; i < n_assets; i++)
+        {
+            int64_t mtime_ns;
+            off_t size;
+            /*Leave it alone until the startup load is done*/
+            if (!future_ready(assets[i].loaded))
+            {
+                continue;
+            }
+            if (!get_file_stamp(assets[i].filename, &mtime_ns, &size))
+            {
+                continue;
+            }
+            if ((mtime_ns == assets[i].mtime_ns) && (size == assets[i].size))
+            {
+                continue;
+            }
+            /*Both planes still in use, look again on the next period*/
+            std_plane *new_std = assets[i].spare.exchange(NULL);
+            if (new_std == NULL)
+            {
+                continue;
+            }
+            /*Wait one more period so a file in the middle of a write is not read*/
+            this_thread::sleep_for(chrono::milliseconds(HOT_RELOAD_PERIOD_MS));
+            int64_t mtime_check;
+            off_t size_check;
+            if (!get_file_stamp(assets[i].filename, &mtime_check, &size_check) ||
+                (mtime_check != mtime_ns) || (size_check != size))
+            {
+                assets[i].spare = new_std;
+                continue;
+            }
+            assets[i].mtime_ns = mtime_ns;
+            assets[i].size = size;
+
+            if (!load_std(assets[i].filename, *new_std))
+            {
+                LOG_TEXT(LOG_WARN, "Reload of %s failed, keeping the old one", assets[i].filename);
+                assets[i].spare = new_std;
+                continue;
+            }
+            build_alias_table(new_std);
+            assets[i].pending = new_std;
+            LOG_TEXT(LOG_INFO, "Reloaded %s", assets[i].filename);
+        }
+    }
+}
+
+/*Called by the render loop at a pattern change, the only place where the pattern sigmas are read*/
+void swap_std_assets(std_asset *assets, uint8_t n_assets, pattern *patterns)
+{
+    for (uint8_t i = 0; i < n_assets; i++)
+    {
+        /*Anything retired at the previous change is not referenced anymore*/
+        if (assets[i].retired != NULL)
+        {
+            assets[i].spare = assets[i].retired;
+            assets[i].retired = NULL;
+        }
+
+        std_plane *new_std = assets[i].pending.exchange(NULL);
+        if (new_std == NULL)
+        {
+            continue;
+        }
+        for (uint8_t p = 0; p < N_PATTERNS; p++)
+        {
+            if (patterns[p].std.data == assets[i].active->data)
             {
-                std = 100000;
+                patterns[p].std = *new_std;
             }
-            memcpy(&hue, &buff[4], 2);
-            uint8_t temp = ((uint8_t *)&hue)[0];
-            ((uint8_t *)&hue)[0] = ((uint8_t *)&hue)[1];
-            ((uint8_t *)&hue)[1] = temp;
-            sigmas[nline*WIDTH + ncol] = std;
         }
+        assets[i].retired = assets[i].active;
+        assets[i].active = new_std;
     }
-    myfile.close();
 }
+#endif
 
 int main( int argc, char** argv )
 {
-    srand(time(NULL));
+    const chrono::steady_clock::time_point startup_begin = chrono::steady_clock::now();
+    log_drain drain;
+    /*--record file saves the inputs of this run, --replay file runs a saved one
+      headless and as fast as possible, --times file writes every frame time,
+      --snapshot file moves the warm start snapshots*/
+    string record_filename, replay_filename, times_filename;
+    string snapshot_filename = SNAPSHOT_FILE;
+    rt_profile profile = {NULL, 0, SCHED_FIFO, 0, false, false};
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "--bench-layout") == 0)
+        {
+            /*The desktop size and the size this build renders at, RASP_MODE is 656x416*/
+            layout_bench(1280, 1024);
+            if ((RENDER_WIDTH != 1280) || (RENDER_HEIGHT != 1024))
+            {
+                layout_bench(RENDER_WIDTH, RENDER_HEIGHT);
+            }
+            return 0;
+        }
+        else if (strcmp(argv[arg], "--mlock") == 0)
+        {
+            profile.lock_memory = true;
+        }
+        else if (arg == argc - 1)
+        {
+            break;
+        }
+        else if (strcmp(argv[arg], "--record") == 0)
+        {
+            record_filename = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--replay") == 0)
+        {
+            replay_filename = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--times") == 0)
+        {
+            times_filename = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--snapshot") == 0)
+        {
+            snapshot_filename = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--rt-cpu") == 0)
+        {
+            profile.cpu = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--rt-prio") == 0)
+        {
+            profile.priority = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "--rt-policy") == 0)
+        {
+            profile.policy = (strcmp(argv[++arg], "rr") == 0) ? SCHED_RR : SCHED_FIFO;
+        }
+        else if (strcmp(argv[arg], "--nice") == 0)
+        {
+            profile.nice_level = atoi(argv[++arg]);
+            profile.set_nice = true;
+        }
+    }
+    const bool headless = !replay_filename.empty();
+
+    uint32_t seed = time(NULL);
+    vector<trace_record> replay;
+    size_t replay_pos = 0;
+    if (headless && !load_trace(replay_filename, &seed, &replay))
+    {
+        cout << "Problems reading the trace " << replay_filename << endl;
+        return -1;
+    }
+    FILE *trace = NULL;
+    if (!record_filename.empty())
+    {
+        trace = open_trace_record(record_filename, seed);
+        if (trace == NULL)
+        {
+            cout << "Problems creating the trace " << record_filename << endl;
+            return -1;
+        }
+    }
+    seed_random(seed);
+    init_sample_tables();
     geometric_form forms[N_FORMS];
 #if (MULTIPLE_GEOMETRIES*MULTIPLE_SIZES)
     createTriangle(1,  &forms[0]);
@@ -466,22 +2430,52 @@ int main( int argc, char** argv )
     {
         testForm(&forms[i]);
     }
+    stamp_tables stamps;
+    build_stamp_tables(forms, &stamps);
 
     /* Allocate all the pattern buffers and place them in the desired order */
     /* color buffers are for the hue value of HSV (ranging from 0 to 360)*/
-    /* sigma buffers are for the standard deviation, they are double */
+    /* sigma buffers are for the standard deviation, stored as a sigma class */
+    /* every one of them, the pixel ring and the final frame come from a single arena */
+    /* the working pattern the samples read is a single plane of tiled cells */
+    const uint8_t n_color_planes = 8;       // 3 rainbows, 5 flags
+    const uint8_t n_std_planes = 5 + 3*HOT_RELOAD;  // 3 loaded (+ spares), flag, base
+    size_t arena_size = n_color_planes*ALIGN_UP(RENDER_WIDTH*RENDER_HEIGHT*3*sizeof(uint16_t), ARENA_ALIGN);
+    arena_size += ALIGN_UP(cell_plane_size(RENDER_WIDTH, RENDER_HEIGHT), ARENA_ALIGN);
+    arena_size += n_std_planes*ALIGN_UP(RENDER_WIDTH*RENDER_HEIGHT*sizeof(uint8_t), ARENA_ALIGN);
+    arena_size += IMPORTANCE_SAMPLING*(3 + 3*HOT_RELOAD)*ALIGN_UP(RENDER_WIDTH*RENDER_HEIGHT*sizeof(alias_entry), ARENA_ALIGN);
+    arena_size += ALIGN_UP(PIXELS_PER_RUN*sizeof(pixel)*N_BUFFERS, ARENA_ALIGN);
+    arena_size += ALIGN_UP(SIZE_PIXELS, ARENA_ALIGN);
+    arena_size += PALETTE_COMPOSITE*ALIGN_UP(RENDER_WIDTH*RENDER_HEIGHT*sizeof(uint16_t), ARENA_ALIGN);
+    arena_size += PALETTE_COMPOSITE*ALIGN_UP(PALETTE_SIZE*sizeof(uint32_t), ARENA_ALIGN);
+    arena_size += WARM_START*2*ALIGN_UP(sizeof(snapshot), ARENA_ALIGN);
+    frame_arena arena(arena_size);
+    if (arena.base == NULL)
+    {
+        cout << "Problems allocating the arena of " << arena_size << " bytes" << endl;
+        return -1;
+    }
 
-    uint16_t *color = (uint16_t*)malloc(WIDTH*HEIGHT*3*sizeof(uint16_t));
+    cell_plane cells = alloc_cell_plane(arena, RENDER_WIDTH, RENDER_HEIGHT);
 
+    /*The planes are allocated here and filled by the startup pool, the initial
+      pattern (rainbow 1 over fullamudi.res) goes first. The pool is declared after
+      patterns, which its jobs write to, so an early return joins it first*/
+    pattern patterns[N_PATTERNS];
+    asset_pool pool;
+
+    color_plane color_rainbow_1 = alloc_color_plane(arena);
+    color_plane color_rainbow_2 = alloc_color_plane(arena);
+    color_plane color_rainbow_3 = alloc_color_plane(arena);
+    pool.add(color_rainbow_1.data, [=]{ create_rainbow(color_rainbow_1, 0); });
 
-    uint16_t *color_rainbow_1 = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
-    uint16_t *color_rainbow_2 = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
-    uint16_t *color_rainbow_3 = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
-    create_rainbow(color_rainbow_1, 0);
-    create_rainbow(color_rainbow_2, 50);
-    create_rainbow(color_rainbow_3, 100);
+    std_plane sigmas_amudimon = alloc_std_plane(arena, IMPORTANCE_SAMPLING);
+    pool.add(sigmas_amudimon.data, [=, &patterns]{ build_std_asset("fullamudi.res", sigmas_amudimon, patterns); });
+
+    pool.add(color_rainbow_2.data, [=]{ create_rainbow(color_rainbow_2, 50); });
+    pool.add(color_rainbow_3.data, [=]{ create_rainbow(color_rainbow_3, 100); });
     
-    uint16_t *color_flag_lgbt = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
+    color_plane color_flag_lgbt = alloc_color_plane(arena);
     uint16_t color_list_lgbt[] = {\
         359, 85, 74,\
           6, 83, 94,\
@@ -490,9 +2484,9 @@ int main( int argc, char** argv )
         226, 64, 64,\
         294, 69, 54
     };
-    create_flag(color_list_lgbt, 6, color_flag_lgbt);
+    pool.add(color_flag_lgbt.data, [=]() mutable { create_flag(color_list_lgbt, 6, color_flag_lgbt); });
 
-    uint16_t *color_flag_bi = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
+    color_plane color_flag_bi = alloc_color_plane(arena);
     uint16_t color_list_bi[] = {\
         332, 89, 85,\
         332, 89, 85,\
@@ -500,9 +2494,9 @@ int main( int argc, char** argv )
         224, 79, 61,\
         224, 79, 61\
     };
-    create_flag(color_list_bi, 5, color_flag_bi);
+    pool.add(color_flag_bi.data, [=]() mutable { create_flag(color_list_bi, 5, color_flag_bi); });
 
-    uint16_t *color_flag_trans = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
+    color_plane color_flag_trans = alloc_color_plane(arena);
     uint16_t color_list_trans[] = {\
         197, 60, 97,\
         347, 33, 97,\
@@ -510,18 +2504,18 @@ int main( int argc, char** argv )
         347, 33, 97,\
         197, 60, 97\
     };
-    create_flag(color_list_trans, 5, color_flag_trans);
+    pool.add(color_flag_trans.data, [=]() mutable { create_flag(color_list_trans, 5, color_flag_trans); });
 
-    uint16_t *color_flag_assex = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
+    color_plane color_flag_assex = alloc_color_plane(arena);
     uint16_t color_list_assex[] = {\
           0,  0,  0,\
           0,  0, 64,\
           0,  0,100,\
         301,100, 51\
     };
-    create_flag(color_list_assex, 4, color_flag_assex);
+    pool.add(color_flag_assex.data, [=]() mutable { create_flag(color_list_assex, 4, color_flag_assex); });
 
-    uint16_t *color_flag_lgbt_2 = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t)*3);
+    color_plane color_flag_lgbt_2 = alloc_color_plane(arena);
     uint16_t color_list_lgbt_2[] = {\
           0,  0,  0,\
          35, 82, 47,\
@@ -532,27 +2526,19 @@ int main( int argc, char** argv )
         218, 98, 69,\
         291, 79, 86,\
     };
-    create_flag(color_list_lgbt_2, 7, color_flag_lgbt_2);
-
+    pool.add(color_flag_lgbt_2.data, [=]() mutable { create_flag(color_list_lgbt_2, 7, color_flag_lgbt_2); });
 
+    std_plane sigmas_amudi = alloc_std_plane(arena, IMPORTANCE_SAMPLING);
+    pool.add(sigmas_amudi.data, [=, &patterns]{ build_std_asset("aMuDi.res", sigmas_amudi, patterns); });
 
-    uint16_t *color_amudi = (uint16_t*)malloc(WIDTH*HEIGHT*sizeof(uint16_t));
-    double *full_sigmas[N_PATTERNS];
-    double *sigmas = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
-    
-    double *sigmas_amudi = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
-    load_std("aMuDi.res", sigmas_amudi);
-
-    double *sigmas_amudimon = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
-    load_std("fullamudi.res", sigmas_amudimon);
-
-    double *sigmas_sedep = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
-    load_std("SEDEP.res", sigmas_sedep);
-
-    double *sigmas_flag = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
-    double *sigmas_base = (double*)malloc(WIDTH*HEIGHT*sizeof(double));
+    std_plane sigmas_sedep = alloc_std_plane(arena, IMPORTANCE_SAMPLING);
+    pool.add(sigmas_sedep.data, [=, &patterns]{ build_std_asset("SEDEP.res", sigmas_sedep, patterns); });
 
-    pattern patterns[N_PATTERNS];
+    /*These two are uniform, there is nothing to importance sample*/
+    std_plane sigmas_flag = alloc_std_plane(arena, false);
+    std_plane sigmas_base = alloc_std_plane(arena, false);
+    pool.add(sigmas_flag.data, [=]{ memset(sigmas_flag.data, sigma_to_class(5), RENDER_WIDTH*RENDER_HEIGHT); });
+    pool.add(sigmas_base.data, [=]{ memset(sigmas_base.data, sigma_to_class(10000), RENDER_WIDTH*RENDER_HEIGHT); });
 
     pattern white_noise = createPattern(sigmas_base, color_rainbow_1);
 
@@ -566,8 +2552,6 @@ int main( int argc, char** argv )
     pattern rainbow2_amudi = createPattern(sigmas_amudimon, color_rainbow_2, CHANGE_N/3, 0);
     pattern rainbow3_amudi = createPattern(sigmas_amudimon, color_rainbow_3, CHANGE_N/3, 0);
 
-    rainbow1_amudi.next_pattern = &rainbow2_amudi;
-    rainbow2_amudi.next_pattern = &rainbow3_amudi;
     rainbow2_amudi.is_first = 0;
     rainbow3_amudi.is_first = 0;
 
@@ -575,8 +2559,6 @@ int main( int argc, char** argv )
     pattern rainbow2_SEDEP = createPattern(sigmas_sedep, color_rainbow_2, CHANGE_N/3, 0);
     pattern rainbow3_SEDEP = createPattern(sigmas_sedep, color_rainbow_3, CHANGE_N/3, 0);
 
-    rainbow1_SEDEP.next_pattern = &rainbow2_SEDEP;
-    rainbow2_SEDEP.next_pattern = &rainbow3_SEDEP;
     rainbow2_SEDEP.is_first = 0;
     rainbow3_SEDEP.is_first = 0;
 
@@ -593,33 +2575,62 @@ int main( int argc, char** argv )
     patterns[9]   = rainbow3_SEDEP;
     patterns[10]  = lgbt_2_flag;
 
+    /*Chain inside the array so every pattern in use lives in patterns*/
+    patterns[4].next_pattern = &patterns[5];
+    patterns[5].next_pattern = &patterns[6];
+    patterns[7].next_pattern = &patterns[8];
+    patterns[8].next_pattern = &patterns[9];
+
     /* Check All sigmas and colors */
     for (uint8_t i = 0; i < N_PATTERNS; i++)
     {
-        if ((patterns[i].std == NULL) || (patterns[i].color == NULL))
+        if ((patterns[i].std.data == NULL) || (patterns[i].color.data == NULL))
         {
             cout << "Problems allocating patterns" << endl;
             return -1;
         }
+        patterns[i].std_ready = pool.ready_of(patterns[i].std.data);
+        patterns[i].color_ready = pool.ready_of(patterns[i].color.data);
     }
-
-
-
-    /*Create some other patterns*/
-    for (uint16_t y = 0; y < HEIGHT; y++)
+#if PARALLEL_STARTUP
+    /*n_workers is a uint8_t, 256 threads would wrap to a serial startup*/
+    pool.start(min(max(1u, thread::hardware_concurrency()), 255u), startup_begin);
+#else
+    pool.start(0, startup_begin);
+#endif
+#if HOT_RELOAD
+    std_asset std_assets[3];
+    std_assets[0].filename = "aMuDi.res";
+    std_assets[0].slots[0] = sigmas_amudi;
+    std_assets[1].filename = "fullamudi.res";
+    std_assets[1].slots[0] = sigmas_amudimon;
+    std_assets[2].filename = "SEDEP.res";
+    std_assets[2].slots[0] = sigmas_sedep;
+    for (uint8_t i = 0; i < 3; i++)
     {
-        for(uint16_t x = 0; x < WIDTH; x++)
-        {
-            color[y*WIDTH + x] = 180;
-            sigmas_flag[y*WIDTH + x] = 5;//pow(2,10*(((double)x)/WIDTH));
-            sigmas_base[y*WIDTH + x] = 10000;
-        }
+        std_assets[i].slots[1] = alloc_std_plane(arena, IMPORTANCE_SAMPLING);
+        std_assets[i].active = &std_assets[i].slots[0];
+        std_assets[i].retired = NULL;
+        std_assets[i].pending = NULL;
+        std_assets[i].spare = &std_assets[i].slots[1];
+        std_assets[i].mtime_ns = 0;
+        std_assets[i].size = 0;
+        std_assets[i].loaded = pool.ready_of(std_assets[i].slots[0].data);
+        get_file_stamp(std_assets[i].filename, &std_assets[i].mtime_ns, &std_assets[i].size);
     }
+#endif
     /*Initialize SDL things*/
-    SDL_Init( SDL_INIT_EVERYTHING );
-    TTF_Init();
-
-    TTF_Font* Sans = TTF_OpenFont("DejaVuSansMono.ttf", 60); //this opens a font style and sets a size
+    SDL_Window* window = NULL;
+    SDL_Renderer* renderer = NULL;
+    SDL_Texture* texture = NULL;
+    TTF_Font* Sans = NULL;
+    if (!headless)
+    {
+        SDL_Init( SDL_INIT_EVERYTHING );
+        TTF_Init();
+        Sans = TTF_OpenFont("DejaVuSansMono.ttf", 60); //this opens a font style and sets a size
+        atexit( SDL_Quit );
+    }
     SDL_Color White = {255, 255, 255};  // this is the color in rgb format, maxing out all would give you the color white, and it will be your text's color
     SDL_Rect Message_rect; //create a rect
     Message_rect.x = 0;  //controls the rect's x coordinate 
@@ -627,37 +2638,40 @@ int main( int argc, char** argv )
     Message_rect.w = 100; // controls the width of the rect
     Message_rect.h = 60; // controls the height of the rect
 
-    atexit( SDL_Quit );
-
-    SDL_Window* window = SDL_CreateWindow
-        (
-        "SDL2",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        WIDTH, HEIGHT,
-        SDL_WINDOW_SHOWN
-        );
-
-    SDL_Renderer* renderer = SDL_CreateRenderer
-        (
-        window,
-        -1,
-        SDL_RENDERER_ACCELERATED
-        );
-
-    SDL_RendererInfo info;
-    SDL_GetRendererInfo( renderer, &info );
-    SDL_Texture* texture = SDL_CreateTexture
-        (
-        renderer,
-        SDL_PIXELFORMAT_ARGB8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        WIDTH, HEIGHT
-        );
+    if (!headless)
+    {
+        /*Smooth the upscale when RENDER_SCALE is above 1*/
+        SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+        window = SDL_CreateWindow
+            (
+            "SDL2",
+            SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+            WIDTH, HEIGHT,
+            SDL_WINDOW_SHOWN
+            );
+
+        renderer = SDL_CreateRenderer
+            (
+            window,
+            -1,
+            SDL_RENDERER_ACCELERATED
+            );
+
+        SDL_RendererInfo info;
+        SDL_GetRendererInfo( renderer, &info );
+        texture = SDL_CreateTexture
+            (
+            renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            RENDER_WIDTH, RENDER_HEIGHT
+            );
+    }
     SDL_Event event;
 
 
     /*pixels will hold all the N_BUFFERS of pixel to draw*/
-    pixel *pixels = (pixel*)malloc(PIXELS_PER_RUN*sizeof(pixel)*N_BUFFERS);
+    pixel *pixels = (pixel*)arena.alloc(PIXELS_PER_RUN*sizeof(pixel)*N_BUFFERS);
     if (pixels == NULL)
     {
         cout << "Problems allocationg pixel" << endl;
@@ -666,327 +2680,555 @@ int main( int argc, char** argv )
 
 
     /*final_pixels are the actually 1920x1080 pixel description*/
-    uint8_t *final_pixels = (uint8_t*)malloc(SIZE_PIXELS);
+    frame_plane frame = {(uint8_t*)arena.alloc(SIZE_PIXELS), RENDER_WIDTH, RENDER_HEIGHT};
+    uint8_t *final_pixels = frame.data;
     if (final_pixels == NULL)
     {
         cout << "Problems allocationg final pixel" << endl;
         return -1;
     }
 
+#if PALETTE_COMPOSITE
+    index_plane index_frame = {(uint16_t*)arena.alloc(RENDER_WIDTH*RENDER_HEIGHT*sizeof(uint16_t)), RENDER_WIDTH, RENDER_HEIGHT};
+    uint32_t *palette = (uint32_t*)arena.alloc(PALETTE_SIZE*sizeof(uint32_t));
+    if ((index_frame.data == NULL) || (palette == NULL))
+    {
+        cout << "Problems allocationg the palette" << endl;
+        return -1;
+    }
+    memset(palette, 0, PALETTE_SIZE*sizeof(uint32_t));
+    /*The age class each ring buffer's palette entries were last faded to*/
+    uint8_t palette_class[N_BUFFERS];
+    memset(palette_class, 0, sizeof(palette_class));
+#endif
+
+#if WARM_START
+    /*The two copies the writer thread takes the snapshots from*/
+    snapshot_writer snapshots;
+    snapshots.fd = -1;
+    snapshots.seq = 0;
+    snapshots.buffers[0] = (snapshot*)arena.alloc(sizeof(snapshot));
+    snapshots.buffers[1] = (snapshot*)arena.alloc(sizeof(snapshot));
+    if ((snapshots.buffers[0] == NULL) || (snapshots.buffers[1] == NULL))
+    {
+        cout << "Problems allocationg the snapshots" << endl;
+        return -1;
+    }
+#endif
+
     memset(final_pixels, 0, SIZE_PIXELS);
     memset(pixels, 0, PIXELS_PER_RUN*sizeof(pixel)*N_BUFFERS);
+    cout << "Arena: " << arena.used/1024 << " KiB used of " << arena.size/1024 << " KiB reserved, hugepages "
+         << (arena.huge ? "on" : "off") << (arena.prefaulted ? ", prefaulted" : "") << endl;
+
+#if HOT_RELOAD
+    /*Started after the last allocation check, an early return would leave it joinable.
+      A replay has to see the same patterns the whole way, and so does the recording*/
+    atomic<bool> watcher_running(!headless && (trace == NULL));
+    thread watcher(watch_std_assets, std_assets, 3, &watcher_running);
+#endif
 
   
     bool running = true;
+    /*Installed after SDL_Init, which sets up its own handlers for these*/
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
     uint16_t cntr = 0;
     uint32_t full_cntr = 0;
+    /*Counts every loop, paused ones too, this is what traces are indexed by*/
+    uint32_t frame_index = 0;
+    uint16_t replay_count = 0;
+    uint16_t last_count_raw = 0;
+    uint32_t count_max = 0;
+    counter_window count_window;
+    count_window.log = NULL;
+    bool count_recorded = false;
+    vector<float> frame_times;
+    chrono::steady_clock::time_point frame_start;
+#if FIXED_TIMESTEP
+    const chrono::steady_clock::duration sim_tick = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0/SIM_TICK_HZ));
+    chrono::steady_clock::time_point sim_time = chrono::steady_clock::now() - sim_tick;
+#endif
 
     /*Load the initial pattern*/
-    double sigma_effect = 1000;
-    double count_A = 0.5, count_B = 0;
-    uint8_t o_show_type = 0, fake_mode = 0, pause_mode = 0, shift_on = 0, white_noise_mode = 1;
-    uint16_t fake_count = 20;
+    frame_uniforms uniforms;
+    controls ctl = {0.5, 0, 0, 0, 0, 0, 1, 20};
     pattern *pattern_ptr = &patterns[4];
+    /*Recorded and replayed runs need every pattern to pick from, the same way each time*/
+    if (headless || (trace != NULL))
+    {
+        pool.join();
+    }
+#if WARM_START
+    /*Carry on from the newest snapshot, a restart by the watchdog should not show*/
+    const bool warm_start = !headless && (trace == NULL);
+    if (warm_start && load_snapshot(snapshot_filename.c_str(), snapshots.buffers[0]))
+    {
+        const snapshot *snap = snapshots.buffers[0];
+        memcpy(pixels, snap->ring, sizeof(snap->ring));
+        cntr = snap->cntr;
+        full_cntr = snap->full_cntr;
+        pattern_ptr = &patterns[snap->pattern_id];
+        update_frame_uniforms(&uniforms, snap->sigma_effect);
+        rng = snap->rng;
+        ctl = snap->ctl;
+        /*Shift is not held any more, otherwise every A/B press would increment*/
+        ctl.shift_on = 0;
+        snapshots.seq = snap->seq;
+#if PALETTE_COMPOSITE
+        for (uint32_t i = 0; i < PIXELS_PER_RUN*N_BUFFERS; i++)
+        {
+            palette[1 + i] = 0xFF000000 | (pixels[i].r << 16) | (pixels[i].g << 8) | pixels[i].b;
+        }
+#endif
+        cout << "Resumed snapshot " << snap->seq << ", pattern " << snap->pattern_id << " at tick " << full_cntr << endl;
+    }
+    atomic<bool> snapshots_running(warm_start && open_snapshot_writer(&snapshots, snapshot_filename.c_str()));
+    if (warm_start && !snapshots_running)
+    {
+        cout << "Problems opening " << snapshot_filename << ", no warm start snapshots" << endl;
+    }
+    thread snapshot_thread(write_snapshots, &snapshots, &snapshots_running);
+    uint32_t last_snapshot = full_cntr;
+#endif
+    /*Every other thread is running by now and keeps the default scheduling*/
+    apply_rt_profile(&profile, arena);
+    pattern_ptr->std_ready.wait();
+    pattern_ptr->color_ready.wait();
+    /*Positions are drawn from the sigmas of the pattern, everything else is read from cells*/
+    std_plane sigmas = pattern_ptr->std;
+    fill_cell_plane(&cells, pattern_ptr->std, pattern_ptr->color);
     while( running )
     {
+        if (frame_index == 1)
+        {
+            LOG(LOG_INFO, "First frame after %.1f ms", chrono::duration<double, milli>(chrono::steady_clock::now() - startup_begin).count());
+        }
+        if (headless)
+        {
+            if (frame_index > 0)
+            {
+                frame_times.push_back(chrono::duration<float, milli>(chrono::steady_clock::now() - frame_start).count());
+            }
+            frame_start = chrono::steady_clock::now();
+        }
 
 
 #if TIME_DEBUG
         const Uint64 start = SDL_GetPerformanceCounter();
-        cout << "pos_start" << endl;
+        LOG(LOG_DEBUG, "pos_start");
 #endif
-        /*Change to the next pattern*/
-        if (((full_cntr)%pattern_ptr->duration) == 0)
+        /*How many simulation ticks this frame has to run, a replay runs the ticks of the trace*/
+        uint16_t ticks = 1;
+#if FIXED_TIMESTEP
+        if (!headless)
         {
-            sigma_effect = 1000;
-            if (pattern_ptr->next_pattern == NULL)
-            {
-                if(!white_noise_mode%2 || rand()%4 == 0)
-                {
-                    do
-                    {
-                        uint16_t sigma_state = rand() % N_PATTERNS;
-                        cout << "sigma_state: " << sigma_state << "\n";
-                        pattern_ptr = &patterns[sigma_state];
-                    }while(!pattern_ptr->is_first);
-                } else {
-                    pattern_ptr = &patterns[0];
-                }
-            }
-            else
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            while (now - sim_time < sim_tick)
             {
-                pattern_ptr = pattern_ptr->next_pattern;
+                this_thread::sleep_for(sim_tick - (now - sim_time));
+                now = chrono::steady_clock::now();
             }
-#if not SMOOTH_TRANSITION
-            for(uint32_t sigma_cntr = 0; sigma_cntr < HEIGHT*WIDTH; sigma_cntr += 1)
+            uint32_t ticks_due = (now - sim_time)/sim_tick;
+            /*Too far behind, drop the time instead of trying to catch up*/
+            if (ticks_due > MAX_TICKS_PER_FRAME)
             {
-                sigmas[sigma_cntr] = pattern_ptr->std[sigma_cntr]; 
-                color[sigma_cntr*3 + 0]  = pattern_ptr->color[sigma_cntr*3 + 0]; 
-                color[sigma_cntr*3 + 1]  = pattern_ptr->color[sigma_cntr*3 + 1]; 
-                color[sigma_cntr*3 + 2]  = pattern_ptr->color[sigma_cntr*3 + 2]; 
+                sim_time = now - sim_tick*MAX_TICKS_PER_FRAME;
+                ticks_due = MAX_TICKS_PER_FRAME;
             }
-#endif
-        }
-#if SMOOTH_TRANSITION
-        /*This creates a soft pattern change, by applying the pattern slowly on top of the old one*/
-        for(uint32_t sigma_cntr = 0; sigma_cntr < HEIGHT*WIDTH; sigma_cntr += 1)
-        {
-            sigmas[sigma_cntr] = sigmas[sigma_cntr]*0.9 + pattern_ptr->std[sigma_cntr]*0.1; 
-            color[sigma_cntr*3 + 0]  = color[sigma_cntr*3 + 0]*0.95  + pattern_ptr->color[sigma_cntr*3 + 0]*0.05;
-            color[sigma_cntr*3 + 1]  = color[sigma_cntr*3 + 1]*0.95  + pattern_ptr->color[sigma_cntr*3 + 1]*0.05;
-            color[sigma_cntr*3 + 2]  = color[sigma_cntr*3 + 2]*0.95  + pattern_ptr->color[sigma_cntr*3 + 2]*0.05;
+            sim_time += sim_tick*ticks_due;
+            ticks = ticks_due;
         }
-#endif        
+#endif
 
 #if TIME_DEBUG
         const Uint64 pos1 = SDL_GetPerformanceCounter();
-        cout << "pos1" << endl;
+        LOG(LOG_DEBUG, "pos1");
 #endif
 
-         /*Jump through the N_BUFFERS*/
-        if (cntr >= N_BUFFERS)
-        {
-            cntr = 0;
-        }       
-
         /*Place SDL background*/
-        SDL_SetRenderDrawColor( renderer, 0, 0, 0, SDL_ALPHA_OPAQUE );
-        SDL_RenderClear( renderer );
+        if (!headless)
+        {
+            SDL_SetRenderDrawColor( renderer, 0, 0, 0, SDL_ALPHA_OPAQUE );
+            SDL_RenderClear( renderer );
+        }
 
 
 #if TIME_DEBUG
         const Uint64 pos2 = SDL_GetPerformanceCounter();
-        cout << "pos2" << endl;
+        LOG(LOG_DEBUG, "pos2");
 #endif
         /*Poll for esc key*/
-        while( SDL_PollEvent( &event ) )
+        while( !headless && SDL_PollEvent( &event ) )
         {
             if( ( SDL_QUIT == event.type ) ||
                 ( SDL_KEYDOWN == event.type && SDL_SCANCODE_ESCAPE == event.key.keysym.scancode ) )
             {
                 running = false;
-                break;
-            }
-            else if (SDL_KEYDOWN == event.type && 225 == event.key.keysym.scancode )
-            {
-                shift_on = 1;
-            }
-            else if (SDL_KEYUP == event.type && 225 == event.key.keysym.scancode )
-            {
-                shift_on = 0;
-            }
-            else if (SDL_KEYDOWN == event.type && 4 == event.key.keysym.scancode )
-            {
-                if (shift_on)
-                {
-                    count_A += 0.01;
-                }
-                else
+                if (trace != NULL)
                 {
-                    count_A -= 0.01;
-                    if (count_A < 0)
-                    {
-                        count_A = 0;
-                    }
+                    write_trace_record(trace, frame_index, TRACE_QUIT, 0);
                 }
+                break;
             }
-            else if (SDL_KEYDOWN == event.type && 5 == event.key.keysym.scancode )
+            handle_key(&ctl, event.type, event.key.keysym.scancode);
+            if ((trace != NULL) && ((SDL_KEYDOWN == event.type) || (SDL_KEYUP == event.type)))
             {
-                if (shift_on)
-                {
-                    count_B += 0.25;
-                }
-                else
-                {
-                    count_B -= 0.25;
-                    if (count_B < 0)
-                    {
-                        count_B = 0;
-                    }
-                }
+                write_trace_record(trace, frame_index, (SDL_KEYDOWN == event.type) ? TRACE_KEY_DOWN : TRACE_KEY_UP,
+                                   event.key.keysym.scancode);
             }
-            else if (SDL_KEYDOWN == event.type && 18 == event.key.keysym.scancode )
+            LOG_EVERY(100, LOG_DEBUG, "Event %.0f, scancode %.0f, shift %.0f, white noise %.0f",
+                      (double)event.type, (double)event.key.keysym.scancode, (double)ctl.shift_on, (double)ctl.white_noise_mode);
+        }
+        if (stop_requested && running)
+        {
+            running = false;
+            if (trace != NULL)
             {
-                o_show_type += 1;
+                write_trace_record(trace, frame_index, TRACE_QUIT, 0);
             }
-            else if (SDL_KEYDOWN == event.type && 9 == event.key.keysym.scancode )
+        }
+        /*Or take them from the trace*/
+        while (headless && (replay_pos < replay.size()) && (replay[replay_pos].frame <= frame_index))
+        {
+            const trace_record &record = replay[replay_pos++];
+            if (record.type == TRACE_COUNT)
             {
-                fake_mode += 1;
+                replay_count = record.value;
             }
-            else if (SDL_KEYDOWN == event.type && (87 == event.key.keysym.scancode || 46 == event.key.keysym.scancode))
+            else if (record.type == TRACE_TICKS)
             {
-                fake_count += 1;
+                ticks = record.value;
             }
-            else if (SDL_KEYDOWN == event.type && (86 == event.key.keysym.scancode || 45 == event.key.keysym.scancode))
+            else if (record.type == TRACE_KEY_DOWN)
             {
-                if (fake_count > 0)
-                {
-                    fake_count -= 1;
-                }
+                handle_key(&ctl, SDL_KEYDOWN, record.value);
             }
-            else if (SDL_KEYDOWN == event.type && 19 == event.key.keysym.scancode )
+            else if (record.type == TRACE_KEY_UP)
             {
-                pause_mode += 1;
+                handle_key(&ctl, SDL_KEYUP, record.value);
             }
-            else if (SDL_KEYDOWN == event.type && 22 == event.key.keysym.scancode )
+            else if (record.type == TRACE_QUIT)
             {
-                white_noise_mode += 1;
+                running = false;
             }
-            cout << SDL_KEYDOWN << "," << event.type << "," << event.key.keysym.scancode << ", " << shift_on << "," << white_noise_mode << "\n";
+        }
+        if (headless && (replay_pos >= replay.size()) && (replay.empty() || (frame_index > replay.back().frame)))
+        {
+            running = false;
+        }
+        if (!running)
+        {
+            break;
+        }
+        if ((trace != NULL) && (ticks != 1))
+        {
+            write_trace_record(trace, frame_index, TRACE_TICKS, ticks);
+        }
+        if ((trace != NULL) && (frame_index % TRACE_FLUSH_FRAMES == 0))
+        {
+            fflush(trace);
         }
 
-        if (pause_mode%2)
+        /*While paused the ticks are dropped, the show continues where it stopped*/
+        if (ctl.pause_mode%2)
         {
             /*Clear the final buffer*/
             memset(final_pixels, 0, SIZE_PIXELS);
 
             /*Update and render the screen*/
-            SDL_UpdateTexture
-                (
-                texture,
-                NULL,
-                &final_pixels[0],
-                WIDTH * 4
-                );
-            SDL_RenderCopy( renderer, texture, NULL, NULL );
-
-            SDL_RenderPresent( renderer );
+            if (!headless)
+            {
+                SDL_UpdateTexture
+                    (
+                    texture,
+                    NULL,
+                    &final_pixels[0],
+                    RENDER_WIDTH * 4
+                    );
+                SDL_RenderCopy( renderer, texture, NULL, NULL );
+
+                SDL_RenderPresent( renderer );
+            }
+            frame_index += 1;
             continue;
         }
 
-
-        /*Create the random pixels*/
-        hsv hsv_val;
-        rgb rgb_val;
-
-        if (((full_cntr+1)%pattern_ptr->duration) < pattern_ptr->transition)
+        /*The people count is read once per frame and used by all of its ticks*/
+        uint16_t count_raw = 0;
+        count_max = 0;
+        if (headless)
         {
-            sigma_effect -= 999.0/pattern_ptr->transition;
+            count_raw = replay_count;
         }
-        else if (((full_cntr+1)%pattern_ptr->duration) > (pattern_ptr->duration - pattern_ptr->transition))
+        else if(ctl.fake_mode%2)
         {
-            sigma_effect += 999.0/pattern_ptr->transition;
+            count_raw = ctl.fake_count;
         }
         else
         {
-            sigma_effect = 1;
-        }
-        if (sigma_effect < 1)
-        {
-            sigma_effect = 1;
-        }
-#if GLOBAL_SIGMA
-        double sigma = pow(2,abs((double)full_cntr - 1000.0)/100);
-#endif  
-        uint16_t count_raw = 0;
-        if(fake_mode%2)
-        {
-            count_raw = fake_count;
+            if ((count_window.log == NULL) && (frame_index % COUNT_LOG_RETRY_FRAMES == 0))
+            {
+                open_counter_window(&count_window, COUNT_WINDOW_MS);
+            }
+            const int64_t now_ms = counter_log_now_ms();
+            bool log_current = false;
+            if ((count_window.log != NULL) && update_counter_window(&count_window, now_ms))
+            {
+                log_current = counter_window_current(&count_window, now_ms);
+                /*It may have been deleted and created again, map it afresh on the next retry*/
+                if (!log_current)
+                {
+                    close_counter_window(&count_window);
+                }
+            }
+            if (log_current)
+            {
+                count_raw = min<long>(lround(counter_window_average(&count_window, now_ms)), UINT16_MAX);
+                count_max = counter_window_max(&count_window);
+            }
+            else
+            {
+                count_raw = getPeopleCount();
+            }
         }
-        else 
+        count_max = max<uint32_t>(count_max, count_raw);
+        if ((trace != NULL) && (!count_recorded || (count_raw != last_count_raw)))
         {
-            count_raw = getPeopleCount();
+            write_trace_record(trace, frame_index, TRACE_COUNT, count_raw);
+            count_recorded = true;
         }
-        uint16_t count = PIXELS_PER_RUN*getPeopleCount(count_A, count_B, count_raw);
+        last_count_raw = count_raw;
+        uint16_t count = PIXELS_PER_RUN*getPeopleCount(ctl.count_A, ctl.count_B, count_raw);
         if (count > PIXELS_PER_RUN)
         {
             count = PIXELS_PER_RUN;
         }
-        for( unsigned int i = 0; i < count; i++ )
-        {
-            /*Get a random position within the image*/
-            const unsigned int x = rand() % WIDTH;
-            const unsigned int y = rand() % HEIGHT;
 
-            /*Get the sigma from table*/
-#if not GLOBAL_SIGMA
-            double sigma = sigmas[y*WIDTH + x]; 
+        /*Every tick adds one buffer of pixels to the ring, they are all drawn by one composite below*/
+        for (uint16_t tick = 0; tick < ticks; tick++)
+        {
+            /*Change to the next pattern*/
+            if (((full_cntr)%pattern_ptr->duration) == 0)
+            {
+#if HOT_RELOAD
+                swap_std_assets(std_assets, 3, patterns);
+#endif
+                /*Patterns still being built at startup are skipped, patterns[4] always is ready*/
+                if ((pattern_ptr->next_pattern == NULL) || !pattern_ready(pattern_ptr->next_pattern))
+                {
+                    if(!ctl.white_noise_mode%2 || next_random()%4 == 0 || !pattern_ready(&patterns[0]))
+                    {
+                        do
+                        {
+                            uint16_t sigma_state = next_random() % N_PATTERNS;
+                            LOG(LOG_DEBUG, "sigma_state: %.0f", (double)sigma_state);
+                            pattern_ptr = &patterns[sigma_state];
+                        }while(!pattern_ptr->is_first || !pattern_ready(pattern_ptr));
+                    } else {
+                        pattern_ptr = &patterns[0];
+                    }
+                }
+                else
+                {
+                    pattern_ptr = pattern_ptr->next_pattern;
+                }
+                /*Positions are drawn with the table of the new pattern*/
+                sigmas = pattern_ptr->std;
+#if not SMOOTH_TRANSITION
+                fill_cell_plane(&cells, pattern_ptr->std, pattern_ptr->color);
+#endif
+            }
+#if SMOOTH_TRANSITION
+            blend_cell_plane(&cells, pattern_ptr->std, pattern_ptr->color);
 #endif
-            /*Get a random hue value and convert it to rgb*/
 
-            sigma *= sqrt(sigma_effect);
-            if (sigma > 1000)
+            /*Jump through the N_BUFFERS*/
+            if (cntr >= N_BUFFERS)
             {
-                sigma = 1000;
+                cntr = 0;
             }
-            hsv_val.h = getRandom(color[(y*WIDTH + x)*3 + 0],sigma,0,360); 
-            if (sigma > 100)
+
+            /*Create the random pixels*/
+            hsv hsv_val;
+            rgb rgb_val;
+
+            update_frame_uniforms(&uniforms, sigma_effect_at(full_cntr, pattern_ptr->duration, pattern_ptr->transition));
+#if GLOBAL_SIGMA
+            double sigma = pow(2,abs((double)full_cntr - 1000.0)/100)*sqrt(uniforms.sigma_effect);
+            for (uint16_t i = 0; i < N_SIGMA_CLASSES; i++)
             {
-                hsv_val.s = 1;
-                hsv_val.v = 1;
+                uniforms.spread[i] = (sigma > 1000) ? 1000 : sigma;
+                uniforms.full_sv[i] = (uniforms.spread[i] > 100);
             }
-            else
+#endif
+            for( unsigned int i = 0; i < count; i++ )
+            {
+                /*Get a random position within the image*/
+                const uint32_t pos = sample_position(&sigmas);
+                const unsigned int x = pos % RENDER_WIDTH;
+                const unsigned int y = pos / RENDER_WIDTH;
+                const cell c = get_cell(&cells, x, y);
+
+                /*Get a random hue value and convert it to rgb, the spread comes from the frame uniforms*/
+                hsv_val.h = getRandom(c.h,uniforms.spread[c.sigma_class],0,360);
+                if (uniforms.full_sv[c.sigma_class])
+                {
+                    hsv_val.s = 1;
+                    hsv_val.v = 1;
+                }
+                else
+                {
+                    hsv_val.s = percent_fraction[min<uint16_t>(c.s, 100)];
+                    hsv_val.v = percent_fraction[min<uint16_t>(c.v, 100)];
+                }
+                rgb_val = hsv2rgb(hsv_val);
+
+                /*Store the value in the buffer*/
+                pixels[PIXELS_PER_RUN*cntr + i].b = (int)(rgb_val.b*255);
+                pixels[PIXELS_PER_RUN*cntr + i].g = (int)(rgb_val.g*255);
+                pixels[PIXELS_PER_RUN*cntr + i].r = (int)(rgb_val.r*255);
+                pixels[PIXELS_PER_RUN*cntr + i].x = x;
+                pixels[PIXELS_PER_RUN*cntr + i].y = y;
+                pixels[PIXELS_PER_RUN*cntr + i].format = next_random()%N_FORMS;
+                pixels[PIXELS_PER_RUN*cntr + i].active = 1;
+            }
+            for (uint16_t i = count; i < PIXELS_PER_RUN; i++)
             {
-                hsv_val.s = ((double)color[(y*WIDTH + x)*3 + 1])/100.0;
-                hsv_val.v = ((double)color[(y*WIDTH + x)*3 + 2])/100.0;
+                pixels[PIXELS_PER_RUN*cntr + i].active = 0;
             }
-            rgb_val = hsv2rgb(hsv_val);
-
-            /*Store the value in the buffer*/
-            pixels[PIXELS_PER_RUN*cntr + i].b = (int)(rgb_val.b*255);
-            pixels[PIXELS_PER_RUN*cntr + i].g = (int)(rgb_val.g*255);       
-            pixels[PIXELS_PER_RUN*cntr + i].r = (int)(rgb_val.r*255);
-            pixels[PIXELS_PER_RUN*cntr + i].x = x;
-            pixels[PIXELS_PER_RUN*cntr + i].y = y;
-            pixels[PIXELS_PER_RUN*cntr + i].format = rand()%N_FORMS;
-            pixels[PIXELS_PER_RUN*cntr + i].active = 1;
+#if PALETTE_COMPOSITE
+            /*Only the slots written this tick change their palette entry*/
+            for (uint16_t i = 0; i < count; i++)
+            {
+                pixel *px = &pixels[PIXELS_PER_RUN*cntr + i];
+                palette[1 + PIXELS_PER_RUN*cntr + i] = 0xFF000000 | (px->r << 16) | (px->g << 8) | px->b;
+            }
+            palette_class[cntr] = 0;
+#endif
+            cntr += 1;
+            full_cntr += 1;
         }
-        for (uint16_t i = count; i < PIXELS_PER_RUN; i++)
+#if WARM_START
+        if (snapshots_running && (full_cntr - last_snapshot >= SNAPSHOT_PERIOD))
         {
-            pixels[PIXELS_PER_RUN*cntr + i].active = 0;
+            take_snapshot(&snapshots, pixels, cntr, full_cntr, pattern_ptr - patterns, uniforms.sigma_effect, &ctl);
+            last_snapshot = full_cntr;
         }
+#endif
+        /*The buffer written by the last tick is the newest one, it is drawn last*/
+        const uint16_t newest = (cntr + N_BUFFERS - 1)%N_BUFFERS;
 
 #if TIME_DEBUG
         const Uint64 pos3 = SDL_GetPerformanceCounter();
-        cout << "pos3" << endl;
+        LOG(LOG_DEBUG, "pos3");
 #endif
 
+#if PALETTE_COMPOSITE
+        /*The fade lives in the palette, only the buffers that moved to the next age class change*/
+        for (uint16_t buffer = 0; buffer < N_BUFFERS; buffer++)
+        {
+            const uint8_t age_class = stamps.age_class[(newest + N_BUFFERS - buffer)%N_BUFFERS];
+            if (palette_class[buffer] != age_class)
+            {
+                bake_palette(palette, pixels, buffer, stamps.fade[age_class]);
+                palette_class[buffer] = age_class;
+            }
+        }
+        /*Clear the index buffer*/
+        memset(index_frame.data, 0, RENDER_WIDTH*RENDER_HEIGHT*sizeof(uint16_t));
+        /*Fill index_frame with the ring slot of the pixels described at each buffer, oldest first*/
+        for (uint16_t sub_cntr = 0; sub_cntr < N_BUFFERS; sub_cntr++)
+        {
+            const uint32_t slot_base = PIXELS_PER_RUN*((sub_cntr + newest + 1)%N_BUFFERS);
+            const uint8_t age_class = stamps.age_class[N_BUFFERS - 1 - sub_cntr];
+            for (uint16_t i = 0; i <  PIXELS_PER_RUN; i++)
+            {
+                pixel px = pixels[slot_base + i];
+                if (px.active)
+                {
+                    const sprite spr = stamps.sprites[px.format][age_class];
+                    add_stamp_indexed(index_frame, &px, &stamps.spans[spr.first], spr.n_spans, 1 + slot_base + i);
+                }
+                else
+                    break;
+
+            }
+        }
+#else
         /*Clear the final buffer*/
         memset(final_pixels, 0, SIZE_PIXELS);
-        /*Fill final_pixels with the pixels described at each buffer*/
+        /*Fill final_pixels with the pixels described at each buffer, oldest first*/
         for (uint16_t sub_cntr = 0; sub_cntr < N_BUFFERS; sub_cntr++)
         {
+            const uint8_t age_class = stamps.age_class[N_BUFFERS - 1 - sub_cntr];
+            const uint8_t *fade = stamps.fade[age_class];
             for (uint16_t i = 0; i <  PIXELS_PER_RUN; i++)
             {
-                pixel px = pixels[PIXELS_PER_RUN*((sub_cntr + cntr + 1)%N_BUFFERS) + i];
+                pixel px = pixels[PIXELS_PER_RUN*((sub_cntr + newest + 1)%N_BUFFERS) + i];
                 if (px.active)
-                    addGeometricForm(final_pixels, WIDTH, HEIGHT, &px, &forms[px.format]);
+                {
+                    const sprite spr = stamps.sprites[px.format][age_class];
+                    add_stamp(frame, &px, &stamps.spans[spr.first], spr.n_spans,
+                              0xFF000000 | (fade[px.r] << 16) | (fade[px.g] << 8) | fade[px.b]);
+                }
                 else
                     break;
 
             }
         }
+#endif
 
 #if TIME_DEBUG
         const Uint64 pos4 = SDL_GetPerformanceCounter();
-        cout << "pos4" << endl;
+        LOG(LOG_DEBUG, "pos4");
 #endif
 
+        if (headless)
+        {
+#if PALETTE_COMPOSITE
+            /*Keep the cost of the expansion in the replay timings*/
+            expand_palette(index_frame, palette, final_pixels, RENDER_WIDTH * 4);
+#endif
+            frame_index += 1;
+            continue;
+        }
+
         /*Update and render the screen*/
+#if PALETTE_COMPOSITE
+        void *texture_pixels;
+        int texture_pitch;
+        if (SDL_LockTexture(texture, NULL, &texture_pixels, &texture_pitch) == 0)
+        {
+            expand_palette(index_frame, palette, (uint8_t*)texture_pixels, texture_pitch);
+            SDL_UnlockTexture(texture);
+        }
+#else
         SDL_UpdateTexture
             (
             texture,
             NULL,
             &final_pixels[0],
-            WIDTH * 4
+            RENDER_WIDTH * 4
             );
+#endif
         SDL_RenderCopy( renderer, texture, NULL, NULL );
 
 
         
-        if (o_show_type%3 != 2 && Sans != NULL)
+        if (ctl.o_show_type%3 != 2 && Sans != NULL)
         {
             string peopleCount_str = "";
 
-            if (o_show_type%3 == 0)
+            if (ctl.o_show_type%3 == 0)
             {
                 peopleCount_str = to_string(count);
                 Message_rect.w = 100; // controls the width of the rect
             }
-            else if (o_show_type%3 == 1)
+            else if (ctl.o_show_type%3 == 1)
             {
-                peopleCount_str = to_string(count) + "/" + to_string(count_raw);
-                Message_rect.w = 200; // controls the width of the rect
+                peopleCount_str = to_string(count) + "/" + to_string(count_raw) + "/" + to_string(count_max);
+                Message_rect.w = 300; // controls the width of the rect
             }
             SDL_Surface* surfaceMessage = TTF_RenderText_Solid(Sans, peopleCount_str.c_str(), White); // as TTF_RenderText_Solid could only be used on SDL_Surface then you have to create the surface first
             
@@ -1010,13 +3252,36 @@ int main( int argc, char** argv )
         const double seconds4 = ( pos4 - pos3 ) / static_cast< double >( freq );
         const double seconds5 = ( end - pos4 ) / static_cast< double >( freq );
         const double seconds = ( end - start ) / static_cast< double >( freq );
-        cout << "\rFrame time: " << seconds1*1000.0 << "|" << seconds2*1000.0 << "|" << seconds3*1000.0 << "|" << seconds4*1000.0 << "|" << seconds5*1000.0 << "|" << seconds * 1000.0 << "ms           " << endl;
+        LOG(LOG_INFO, "Frame time: %.3f|%.3f|%.3f|%.3f|%.3f|%.3fms", seconds1*1000.0, seconds2*1000.0, seconds3*1000.0, seconds4*1000.0, seconds5*1000.0, seconds*1000.0);
 #endif
-        cntr += 1;
-        full_cntr += 1;
+        frame_index += 1;
+    }
+
+    if (trace != NULL)
+    {
+        fclose(trace);
+    }
+    if (headless)
+    {
+        report_frame_times(frame_times, times_filename);
     }
 
-    SDL_DestroyRenderer( renderer );
-    SDL_DestroyWindow( window );
-    SDL_Quit();
+#if HOT_RELOAD
+    watcher_running = false;
+    watcher.join();
+#endif
+#if WARM_START
+    snapshots_running = false;
+    snapshot_thread.join();
+    if (snapshots.fd >= 0)
+    {
+        close(snapshots.fd);
+    }
+#endif
+    if (!headless)
+    {
+        SDL_DestroyRenderer( renderer );
+        SDL_DestroyWindow( window );
+        SDL_Quit();
+    }
 }
@@ -0,0 +1,129 @@
+#ifndef COUNTER_LOG_H
+#define COUNTER_LOG_H
+
+/*The people count history, a fixed size ring of samples in a memory mapped file.
+  reader.cpp appends a sample for every reading of the counter, brisaSEDEP maps the
+  same file read only and asks it for averages and maxima over a window*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COUNTER_LOG_FILE        "counter.log"
+#define COUNTER_LOG_MAGIC       0x474C4342      // "BCLG"
+#define COUNTER_LOG_VERSION     1
+#define COUNTER_LOG_CAPACITY    65536           // samples, a power of two
+
+/*The count holds from time_ms until the next sample. area is the integral of the
+  count over time from the first sample up to time_ms, in count*ms, so the average
+  between two samples is the difference of their areas over the time between them*/
+typedef struct {
+    int64_t     time_ms;        // CLOCK_REALTIME
+    uint32_t    count;
+    uint32_t    reserved;
+    uint64_t    area;
+} counter_sample;
+
+typedef struct {
+    uint32_t        magic;      // written last when the file is created
+    uint32_t        version;
+    uint32_t        capacity;
+    uint32_t        reserved;
+    uint64_t        n_samples;  // ever written, sample n lives in slot n%capacity
+    counter_sample  samples[COUNTER_LOG_CAPACITY];
+} counter_log;
+
+inline int64_t counter_log_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+inline const counter_sample *counter_log_sample(const counter_log *log, uint64_t n)
+{
+    return &log->samples[n & (COUNTER_LOG_CAPACITY - 1)];
+}
+
+/*Samples published so far, the sample itself is written before n_samples moves*/
+inline uint64_t counter_log_size(const counter_log *log)
+{
+    return __atomic_load_n(&log->n_samples, __ATOMIC_ACQUIRE);
+}
+
+/*Maps the log, for_writing creates or resets a file that is missing or not a log.
+  Returns NULL when there is no usable log*/
+inline counter_log *map_counter_log(const char *filename, bool for_writing)
+{
+    int fd = open(filename, for_writing ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    const bool complete = ((size_t)st.st_size == sizeof(counter_log));
+    if (!complete && (!for_writing || (ftruncate(fd, sizeof(counter_log)) != 0)))
+    {
+        close(fd);
+        return NULL;
+    }
+    void *mem = mmap(NULL, sizeof(counter_log), for_writing ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        return NULL;
+    }
+    counter_log *log = (counter_log*)mem;
+    const bool valid = (log->magic == COUNTER_LOG_MAGIC) && (log->version == COUNTER_LOG_VERSION) &&
+                       (log->capacity == COUNTER_LOG_CAPACITY);
+    if (!valid && for_writing)
+    {
+        memset(log, 0, sizeof(counter_log));
+        log->version = COUNTER_LOG_VERSION;
+        log->capacity = COUNTER_LOG_CAPACITY;
+        __atomic_store_n(&log->magic, COUNTER_LOG_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (!valid)
+    {
+        munmap(mem, sizeof(counter_log));
+        return NULL;
+    }
+    return log;
+}
+
+inline void unmap_counter_log(const counter_log *log)
+{
+    munmap((void*)log, sizeof(counter_log));
+}
+
+/*Only one writer, the readers never see a sample before it is complete*/
+inline void append_counter_sample(counter_log *log, int64_t time_ms, uint32_t count)
+{
+    const uint64_t n = log->n_samples;
+    counter_sample *sample = &log->samples[n & (COUNTER_LOG_CAPACITY - 1)];
+    uint64_t area = 0;
+    if (n > 0)
+    {
+        const counter_sample *last = counter_log_sample(log, n - 1);
+        /*A clock step backwards adds nothing instead of a negative area*/
+        const int64_t held_ms = (time_ms > last->time_ms) ? (time_ms - last->time_ms) : 0;
+        area = last->area + (uint64_t)last->count*held_ms;
+        time_ms = (time_ms > last->time_ms) ? time_ms : last->time_ms;
+    }
+    sample->time_ms = time_ms;
+    sample->count = count;
+    sample->reserved = 0;
+    sample->area = area;
+    __atomic_store_n(&log->n_samples, n + 1, __ATOMIC_RELEASE);
+}
+
+#endif
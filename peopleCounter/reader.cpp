@@ -0,0 +1,146 @@
+/*Reads the people count from the ESP8266 and appends it to the counter log, see
+  counterLog.h. It also keeps counter.bin with the latest value, as reader.py did.
+  Compile with 'g++ peopleCounter/reader.cpp -o peopleCounter/reader'*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <iostream>
+#include <fstream>
+#include "counterLog.h"
+
+using namespace std;
+
+#define READ_SIZE       50
+#define READ_TIMEOUT_MS 1000
+#define PACKET_SIZE     5
+
+/*The serial port raw at 115200 8N1, as pyserial opens it*/
+int open_serial(const char *port)
+{
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, B115200);
+    cfsetospeed(&tty, B115200);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*Up to READ_SIZE bytes or whatever arrived in READ_TIMEOUT_MS, like ser.read(50) with
+  timeout=1. Returns -1 when the port is gone*/
+int read_serial(int fd, uint8_t *data)
+{
+    int n = 0;
+    const int64_t deadline = counter_log_now_ms() + READ_TIMEOUT_MS;
+    while (n < READ_SIZE)
+    {
+        const int64_t left = deadline - counter_log_now_ms();
+        if (left <= 0)
+        {
+            break;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        const int ready = poll(&pfd, 1, left);
+        if ((ready < 0) && (errno != EINTR))
+        {
+            return -1;
+        }
+        if (ready <= 0)
+        {
+            continue;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            return -1;
+        }
+        const ssize_t got = read(fd, data + n, READ_SIZE - n);
+        if (got < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            return -1;
+        }
+        n += got;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        cout << "Command should be 'reader serialport'\n, where serialport is the port to communicate, for linux something like /dev/ttyUSB0" << endl;
+        return 0;
+    }
+    int fd = open_serial(argv[1]);
+    if (fd < 0)
+    {
+        cout << "Problems opening " << argv[1] << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    counter_log *log = map_counter_log(COUNTER_LOG_FILE, true);
+    if (log == NULL)
+    {
+        cout << "Problems mapping " << COUNTER_LOG_FILE << endl;
+        return -1;
+    }
+
+    uint8_t data[READ_SIZE];
+    while (true)
+    {
+        const int n = read_serial(fd, data);
+        if (n < 0)
+        {
+            /*runReader.sh starts it again*/
+            cout << "Lost " << argv[1] << endl;
+            return -1;
+        }
+        /*A packet is "000" followed by the little endian number of MACs*/
+        if ((n == PACKET_SIZE) && (data[0] == '0') && (data[1] == '0') && (data[2] == '0'))
+        {
+            const uint16_t nmacs = data[3] | (data[4] << 8);
+            const int64_t now_ms = counter_log_now_ms();
+            append_counter_sample(log, now_ms, nmacs);
+
+            /*Still kept for fakecounter.py and renderers started without the log*/
+            ofstream bin("counter.bin", ios::out | ios::binary | ios::trunc);
+            bin.write((const char*)&nmacs, sizeof(nmacs));
+            bin.close();
+
+            const time_t seconds = now_ms/1000;
+            char stamp[32], line[64];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+            snprintf(line, sizeof(line), "%s.%03d %u", stamp, (int)(now_ms%1000), nmacs);
+            cout << line << endl;
+        }
+        else if (n == PACKET_SIZE)
+        {
+            cout << (int)data[0] << endl;
+        }
+    }
+}
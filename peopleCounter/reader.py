@@ -15,9 +15,6 @@ while True:
 
         nmacs = struct.unpack("<H", data[3:])[0]
         line = str(datetime.datetime.now()) + ' ' + str(nmacs) + '\n'
-        f = open('counter.txt', 'a')
-        f.write(line)
-        f.close()
         f = open('counter.bin', 'wb')
         f.write(struct.pack("<H", nmacs))
         f.close()
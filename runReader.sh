@@ -1,4 +1,4 @@
 while [ 1 -eq 1 ];do
-    python2 peopleCounter/reader.py /dev/ttyUSB0
+    ./peopleCounter/reader /dev/ttyUSB0
     sleep 1
 done